@@ -94,6 +94,45 @@ flush_block(void *addr)
 
 }
 
+// Clear the PTE_D bits of the 'n' blocks in 'v' with one system call.
+static void
+clear_dirty(const struct PageMap *v, int n)
+{
+	int r;
+
+	if (n && (r = sys_page_mapv(0, 0, v, n)) < n) {
+		// v[r] failed; map it alone for the error
+		if (r >= 0)
+			r = sys_page_mapv(0, 0, v + r, 1);
+		panic("in flush_blocks, sys_page_mapv: %e", r);
+	}
+}
+
+// Like flush_block for each of the 'n' blocks from 'blockno', but
+// clear the dirty bits of up to PAGEV_MAX blocks at a time.
+void
+flush_blocks(uint32_t blockno, uint32_t n)
+{
+	struct PageMap v[PAGEV_MAX];
+	void *addr;
+	int nv = 0, r;
+
+	for (; n > 0; blockno++, n--) {
+		addr = diskaddr(blockno);
+		if (!va_is_mapped(addr) || !va_is_dirty(addr))
+			continue;
+		if ((r = ide_write(blockno * (BLKSIZE / SECTSIZE), addr, BLKSIZE / SECTSIZE)) < 0)
+			panic("in flush_blocks, ide_write: %e", r);
+		v[nv].pm_srcva = v[nv].pm_dstva = addr;
+		v[nv].pm_perm = uvpt[PGNUM(addr)] & PTE_SYSCALL;
+		if (++nv == PAGEV_MAX) {
+			clear_dirty(v, nv);
+			nv = 0;
+		}
+	}
+	clear_dirty(v, nv);
+}
+
 // Test that the block cache works, by smashing the superblock and
 // reading it back.
 static void
@@ -377,6 +377,29 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	return count;
 }
 
+// Whether reading count bytes from f at offset can be done without
+// going to the disk: every block it touches, and the indirect block if
+// it needs that, is already in the block cache.
+bool
+file_is_cached(struct File *f, off_t offset, size_t count)
+{
+	uint32_t bno, *pdiskbno;
+
+	if (offset >= f->f_size)
+		return 1;
+	count = MIN(count, f->f_size - offset);
+	for (bno = offset / BLKSIZE; bno * BLKSIZE < offset + count; bno++) {
+		if (bno >= NDIRECT && f->f_indirect
+		    && !va_is_mapped(diskaddr(f->f_indirect)))
+			return 0;
+		if (file_block_walk(f, bno, &pdiskbno, 0) < 0)
+			return 1;
+		if (*pdiskbno && !va_is_mapped(diskaddr(*pdiskbno)))
+			return 0;
+	}
+	return 1;
+}
+
 
 // Write count bytes from buf into f, starting at seek position
 // offset.  This is meant to mimic the standard pwrite function.
@@ -487,8 +510,6 @@ file_flush(struct File *f)
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	flush_blocks(1, super->s_nblocks - 1);
 }
 
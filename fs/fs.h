@@ -26,6 +26,7 @@ void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	flush_blocks(uint32_t blockno, uint32_t n);
 void	bc_init(void);
 
 /* fs.c */
@@ -34,6 +35,7 @@ int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
+bool	file_is_cached(struct File *f, off_t offset, size_t count);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
 void	file_flush(struct File *f);
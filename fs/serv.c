@@ -48,6 +48,33 @@ struct OpenFile opentab[MAXOPEN] = {
 // Virtual address at which to receive page mappings containing client requests.
 union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
 
+// Each client's request page, its fsipcbuf, is mapped here for good
+// once the client has sent it with a request: at fschan_ipc(client),
+// one page per environment slot.  Later requests carry no page, only
+// the request code, and the server finds the arguments in the channel.
+// A request that does carry a page (re)opens the client's channel.
+#define FSCHAN		0x0f000000
+#define fschan_ipc(envid) \
+	((union Fsipc *) (FSCHAN + ENVX(envid) * PGSIZE))
+
+envid_t fschan[NENV];	// Client whose page each channel holds, or 0
+
+// A read that has to wait for the disk is parked while the server
+// answers requests it can serve from the block cache, so one client's
+// disk read does not hold up everybody else's.  Its arguments stay in
+// the client's channel meanwhile.
+#define FSPARK_MAX	8
+
+struct Fspark {
+	envid_t p_whom;		// Client of the parked request, or 0
+	uint32_t p_req;
+	uint32_t p_handle;	// Reply handle, 0 if the client used ipc_send
+	uint32_t p_seq;		// Order in which requests were parked
+};
+
+struct Fspark fsparked[FSPARK_MAX];
+int nparked;
+
 void
 serve_init(void)
 {
@@ -305,41 +332,149 @@ fshandler handlers[] = {
 	[FSREQ_SYNC] =		serve_sync
 };
 
+// Serve request 'req' from whom, whose argument page is mapped at ipc.
+// Returns the value to reply with, and stores any page to send back
+// in *pg_store.
+static int
+serve_req(envid_t whom, uint32_t req, union Fsipc *ipc, void **pg_store,
+	  int *perm_store)
+{
+	*pg_store = NULL;
+	if (req == FSREQ_OPEN)
+		return serve_open(whom, (struct Fsreq_open*)ipc, pg_store,
+				  perm_store);
+	if (req < ARRAY_SIZE(handlers) && handlers[req])
+		return handlers[req](whom, ipc);
+	cprintf("Invalid request code %d from %08x\n", req, whom);
+	return -E_INVAL;
+}
+
+// Reply r (and pg with perm) to whom, outside ipc_reply_wait.  Clients
+// that used ipc_call left a reply handle; others used ipc_send and
+// will ipc_recv the reply.  Replies to clients that went away are
+// dropped.
+static void
+serve_reply(envid_t whom, uint32_t handle, int r, void *pg, int perm)
+{
+	if (handle)
+		ipc_reply(whom, handle, r, pg, perm);
+	else
+		sys_ipc_try_send(whom, r, pg ? pg : (void *) UTOP, perm);
+}
+
+// Whether the read request in ipc can be answered from the block cache.
+static bool
+serve_read_cached(envid_t whom, union Fsipc *ipc)
+{
+	struct OpenFile *o;
+
+	// A bad request fails without touching the disk.
+	if (openfile_lookup(whom, ipc->read.req_fileid, &o) < 0)
+		return 1;
+	return file_is_cached(o->o_file, o->o_fd->fd_offset,
+			      MIN(ipc->read.req_n, sizeof(ipc->readRet.ret_buf)));
+}
+
+// Serve the oldest parked request and reply to it.  A request whose
+// client has lost its channel, because the client exited and its slot
+// went to a new environment, is dropped instead: its channel page is
+// no longer the client's.
+static void
+serve_parked(void)
+{
+	struct Fspark *p = NULL;
+	void *pg;
+	int i, r, perm;
+
+	for (i = 0; i < FSPARK_MAX; i++)
+		if (fsparked[i].p_whom
+		    && (!p || fsparked[i].p_seq < p->p_seq))
+			p = &fsparked[i];
+	if (fschan[ENVX(p->p_whom)] == p->p_whom) {
+		r = serve_req(p->p_whom, p->p_req, fschan_ipc(p->p_whom),
+			      &pg, &perm);
+		serve_reply(p->p_whom, p->p_handle, r, pg, perm);
+	}
+	p->p_whom = 0;
+	nparked--;
+}
+
+// Make the page whom sent at fsreq its request channel.  If the channel
+// slot belonged to an environment that has since exited, drop that
+// environment's parked requests and its page first.
+static int
+serve_chan_open(envid_t whom)
+{
+	int i, r;
+
+	if (fschan[ENVX(whom)] && fschan[ENVX(whom)] != whom) {
+		for (i = 0; i < FSPARK_MAX; i++)
+			if (fsparked[i].p_whom
+			    && ENVX(fsparked[i].p_whom) == ENVX(whom)) {
+				fsparked[i].p_whom = 0;
+				nparked--;
+			}
+		fschan[ENVX(whom)] = 0;
+		sys_page_unmap(0, fschan_ipc(whom));
+	}
+	if ((r = sys_page_map(0, fsreq, 0, fschan_ipc(whom),
+			      PTE_P | PTE_U | PTE_W)) < 0)
+		return r;
+	fschan[ENVX(whom)] = whom;
+	return sys_page_unmap(0, fsreq);
+}
+
 void
 serve(void)
 {
-	uint32_t req, whom;
-	int perm, r;
-	void *pg;
+	uint32_t req, whom = 0, handle = 0, seq = 0;
+	int perm, r = 0, i;
+	union Fsipc *ipc;
+	void *pg = NULL;
 
 	while (1) {
-		//cprintf("are you realy hanging all the time?\n");
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
-		if (debug)
-			cprintf("fs req %d from %08x [page %08x: %s]\n",
-				req, whom, uvpt[PGNUM(fsreq)], fsreq);
-		//cprintf("yes! recv! %d == %d ?\n", req, FSREQ_OPEN);
-		// All requests must contain an argument page
-		if (!(perm & PTE_P)) {
-			cprintf("Invalid request from %08x: no argument page\n",
-				whom);
-			continue; // just leave it hanging...
+		// Do the disk work for parked requests only while no other
+		// request waits, sending the last reply first.
+		while (nparked > 0 && thisenv->env_ipc_queued == 0) {
+			if (whom)
+				serve_reply(whom, handle, r, pg, perm);
+			whom = 0;
+			serve_parked();
 		}
+
+		// Reply to the last request, if any, and wait for the next
+		// one.  The client is blocked in ipc_call, so the reply
+		// runs it without a trip through the scheduler.
+		req = ipc_reply_wait(whom, r, pg, perm, (envid_t *) &whom,
+				     fsreq, &perm);
+		handle = thisenv->env_ipc_handle;
 		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-			//cprintf("what indeed have you got? %d\n", r);
-		} else if (req < ARRAY_SIZE(handlers) && handlers[req]) {
-			r = handlers[req](whom, fsreq);
-		} else {
-			cprintf("Invalid request code %d from %08x\n", req, whom);
+		if ((perm & PTE_P) && (r = serve_chan_open(whom)) < 0)
+			continue;
+		// All requests need an argument page, sent now or before
+		if (fschan[ENVX(whom)] != whom) {
+			cprintf("Invalid request from %08x: no argument page\n",
+				whom);
 			r = -E_INVAL;
+			continue;
+		}
+		ipc = fschan_ipc(whom);
+		if (debug)
+			cprintf("fs req %d from %08x [page %08x: %s]\n",
+				req, whom, uvpt[PGNUM(ipc)], ipc);
+		if (req == FSREQ_READ && nparked < FSPARK_MAX
+		    && !serve_read_cached(whom, ipc)) {
+			for (i = 0; fsparked[i].p_whom; i++)
+				;
+			fsparked[i].p_whom = whom;
+			fsparked[i].p_req = req;
+			fsparked[i].p_handle = handle;
+			fsparked[i].p_seq = seq++;
+			nparked++;
+			whom = 0;
+			continue;
 		}
-		//cprintf("to whom you send? %08x\nwhat value is about to send? %d\n", whom, r);
-		//cprintf ("at %s, line %d\n", __FILE__, __LINE__);
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		r = serve_req(whom, req, ipc, &pg, &perm);
 	}
 }
 
@@ -29,6 +29,16 @@ typedef int32_t envid_t;
 #define NENV			(1 << LOG2NENV)
 #define ENVX(envid)		((envid) & (NENV - 1))
 
+// How many exited children an environment remembers for sys_env_wait
+#define ENV_EXITED_MAX		8
+
+// Most IPC messages the kernel queues for an environment that is not
+// receiving (see sys_ipc_try_send)
+#define ENV_IPCQ_MAX		16
+
+// Most senders an environment can limit a receive to
+#define ENV_IPC_FROM_MAX	8
+
 // Values of env_status in struct Env
 enum {
 	ENV_FREE = 0,
@@ -53,6 +63,23 @@ struct Env {
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
+	int env_oncpu;			// CPU whose address space is env's, or -1
+
+	// Scheduling
+	struct Env *env_rq_next;	// Next env on its run queue
+	struct Env *env_rq_prev;	// Previous env on its run queue
+	int env_rq_cpu;			// CPU whose run queue holds env, or -1
+	uint64_t env_stop_tsc;		// Time stamp when env last left a CPU
+
+	// Sleeping (see kern/waitq.h)
+	struct WaitQueue *env_waitq;	// Queue env sleeps on, or NULL
+	struct Env *env_wait_next;	// Next env on that queue
+	uint32_t env_wait_key;		// What env is waiting for
+
+	// Children (see sys_env_wait)
+	int env_nchildren;		// Children not yet freed
+	int env_nexited;		// Entries in env_exited
+	envid_t env_exited[ENV_EXITED_MAX];	// Freed children, oldest first
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
@@ -60,12 +87,30 @@ struct Env {
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
 
+	// System call ring, or NULL (see sys_ring_setup)
+	struct PageInfo *env_ring;
+
 	// Lab 4 IPC
-	bool env_ipc_recving;		// Env is blocked receiving
+	uint32_t env_ipc_recving;	// Env is blocked receiving
+	int env_ipc_nfrom;		// Senders env receives from, 0 if any
+	envid_t env_ipc_from_set[ENV_IPC_FROM_MAX];
+	envid_t env_ipc_callee;		// Env blocked in sys_ipc_call awaits
+					// a reply from this env, or 0
+	uint32_t env_ipc_callno;	// Number of env's latest sys_ipc_call
 	void *env_ipc_dstva;		// VA at which to map received page
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	int env_ipc_npages;		// Pages dstva has room for, then
+					// pages received
+	uint32_t env_ipc_handle;	// Reply handle of a received call, or 0
+
+	// Messages sent while env was not receiving (see kern/ipc.h)
+	struct IpcMsg *env_ipc_qhead;	// Oldest queued message
+	struct IpcMsg *env_ipc_qtail;	// Newest queued message
+	uint32_t env_ipc_queued;	// Queue depth (a futex word)
+	uint32_t env_ipc_qmax;		// Deepest the queue has been
+	uint32_t env_ipc_drops;		// Sends refused with a full queue
 };
 
 #endif // !JOS_INC_ENV_H
@@ -44,6 +44,7 @@ char*	readline(const char *buf);
 // syscall.c
 void	sys_cputs(const char *string, size_t len);
 int	sys_cgetc(void);
+int	sys_cgetc_wait(void);
 envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
@@ -56,7 +57,28 @@ int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_try_sendv(envid_t to_env, uint32_t value,
+			  const struct IpcSeg *segs, int nsegs, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_recvv(void *rcv_pg, int npages);
+int	sys_ipc_recv_from(void *rcv_pg, int npages, const envid_t *from,
+			  int nfrom);
+envid_t	sys_fork(void);
+int	sys_page_mapv(envid_t src_env, envid_t dst_env,
+		      const struct PageMap *v, int n);
+int	sys_page_alloc_range(envid_t env, void *va, int npages, int perm);
+int	sys_page_unmap_range(envid_t env, void *va, int npages);
+int	sys_ring_setup(void *va);
+int	sys_ring_enter(uint32_t to_submit);
+int	sys_futex_wait(const volatile uint32_t *addr, uint32_t val);
+int	sys_futex_wake(volatile uint32_t *addr, int n);
+int	sys_env_wait(envid_t envid);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *srcva, int perm,
+		     void *dstva);
+int	sys_ipc_reply(envid_t to_env, uint32_t handle, uint32_t value,
+		      void *srcva, int perm);
+int	sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *srcva,
+			   int perm, void *dstva);
 
 // This must be inlined.  Exercise for reader: why?
 static inline envid_t __attribute__((always_inline))
@@ -72,10 +94,21 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+void	ipc_sendv(envid_t to_env, uint32_t value, const struct IpcSeg *segs,
+		  int nsegs, int perm);
+int32_t	ipc_recvv(envid_t *from_env_store, void *pg, int npages,
+		  int *perm_store, int *npages_store);
 envid_t	ipc_find_env(enum EnvType type);
+int32_t	ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t	ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
+int32_t	ipc_recv_from(const envid_t *from, int nfrom, envid_t *from_env_store,
+		      void *pg, int *perm_store);
+int	ipc_reply(envid_t to_env, uint32_t handle, uint32_t value, void *pg,
+		  int perm);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
 
@@ -99,6 +132,11 @@ int	sync(void);
 // pageref.c
 int	pageref(void *addr);
 
+// ring.c
+int	ring_queue(int num, uint32_t a1, uint32_t a2, uint32_t a3,
+		   uint32_t a4, uint32_t a5);
+int	ring_flush(void);
+
 
 // spawn.c
 envid_t	spawn(const char *program, const char **argv);
@@ -116,6 +154,7 @@ int	pipeisclosed(int pipefd);
 
 // wait.c
 void	wait(envid_t env);
+envid_t	wait_any(void);
 
 /* File open modes */
 #define	O_RDONLY	0x0000		/* open for reading only */
@@ -185,6 +185,13 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Buddy allocator state, valid while the page heads a free block:
+	// the previous block on the same free list, and log2 of the block's
+	// size in pages.
+	struct PageInfo *pp_prev;
+	uint8_t pp_order;
+	uint8_t pp_flags;
 };
 
 #endif /* !__ASSEMBLER__ */
@@ -0,0 +1,40 @@
+// System call ring shared between an environment and the kernel.
+//
+// The environment queues system calls in the submission queue, then
+// has the kernel make all of them with one sys_ring_enter.  For each
+// system call it makes, the kernel posts the result in the completion
+// queue.  Indices run freely and are taken modulo the queue sizes;
+// each side only advances the indices it owns.
+
+#ifndef JOS_INC_RING_H
+#define JOS_INC_RING_H
+
+#include <inc/types.h>
+
+#define RING_SQ_SIZE	64	// Powers of 2
+#define RING_CQ_SIZE	64
+
+// A queued system call.  Only SYS_page_alloc, SYS_page_map,
+// SYS_page_unmap and SYS_ipc_try_send may be queued.
+struct RingSqe {
+	uint32_t sqe_num;		// System call number
+	uint32_t sqe_args[5];		// Its arguments
+	uint32_t sqe_data;		// Returned in the completion
+};
+
+struct RingCqe {
+	int32_t cqe_res;		// The system call's return value
+	uint32_t cqe_data;		// sqe_data of the submission
+};
+
+// Fills at most one page
+struct SysRing {
+	volatile uint32_t sr_sq_head;	// Next to make; advanced by kernel
+	volatile uint32_t sr_sq_tail;	// Next free; advanced by user
+	volatile uint32_t sr_cq_head;	// Next to reap; advanced by user
+	volatile uint32_t sr_cq_tail;	// Next to post; advanced by kernel
+	struct RingSqe sr_sq[RING_SQ_SIZE];
+	struct RingCqe sr_cq[RING_CQ_SIZE];
+};
+
+#endif /* !JOS_INC_RING_H */
@@ -17,7 +17,41 @@ enum {
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_fork,
+	SYS_page_mapv,
+	SYS_page_alloc_range,
+	SYS_page_unmap_range,
+	SYS_ring_setup,
+	SYS_ring_enter,
+	SYS_cgetc_wait,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_env_wait,
+	SYS_ipc_call,
+	SYS_ipc_reply_wait,
+	SYS_ipc_try_sendv,
+	SYS_ipc_reply,
 	NSYSCALLS
 };
 
+// One entry of the vector passed to sys_page_mapv.
+struct PageMap {
+	void *pm_srcva;
+	void *pm_dstva;
+	int pm_perm;
+};
+
+// Most entries sys_page_mapv takes at once
+#define PAGEV_MAX	64
+
+// One range of pages granted by sys_ipc_try_sendv.
+struct IpcSeg {
+	void *is_va;
+	int is_npages;
+};
+
+// Most ranges, and most pages in all, that one IPC message grants
+#define IPCV_MAX	16
+#define IPC_PAGES_MAX	1024
+
 #endif /* !JOS_INC_SYSCALL_H */
@@ -240,6 +240,39 @@ cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *e
 		*edxp = edx;
 }
 
+// Model-specific registers for sysenter/sysexit
+#define MSR_IA32_SYSENTER_CS	0x174	// Kernel %cs; %ss is %cs + 8
+#define MSR_IA32_SYSENTER_ESP	0x175	// Kernel %esp
+#define MSR_IA32_SYSENTER_EIP	0x176	// Kernel entry point
+
+static inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint64_t val;
+	asm volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
+// Does this CPU have sysenter and sysexit?  The earliest Pentium Pros
+// claim to but do not.
+static inline bool
+cpu_has_sysenter(void)
+{
+	uint32_t eax, edx;
+
+	cpuid(1, &eax, NULL, NULL, &edx);
+	if (!(edx & (1 << 11)))		// SEP
+		return 0;
+	return !(((eax >> 8) & 0xf) == 6 && ((eax >> 4) & 0xf) < 3
+		 && (eax & 0xf) < 3);
+}
+
 static inline uint64_t
 read_tsc(void)
 {
@@ -261,6 +294,17 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t inc)
+{
+	// Atomically add inc to *addr and return the old value of *addr.
+	asm volatile("lock; xaddl %0, %1"
+		     : "+r" (inc), "+m" (*addr)
+		     :
+		     : "cc", "memory");
+	return inc;
+}
+
 static inline uint32_t
 read_dr6()
 {
@@ -9,6 +9,9 @@
 #include <kern/console.h>
 #include <kern/trap.h>
 #include <kern/picirq.h>
+#include <kern/spinlock.h>
+#include <kern/pmap.h>
+#include <kern/waitq.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
@@ -398,19 +401,35 @@ static struct {
 	uint32_t wpos;
 } cons;
 
+static struct spinlock cons_lock;	// Protects the input buffer
+static struct WaitQueue cons_waitq;	// Envs waiting for input
+
+// Serializes console output.  cprintf holds it for a whole message,
+// so that messages from different CPUs do not interleave.
+static struct spinlock cons_out_lock;
+
 // called by device interrupt routines to feed input characters
 // into the circular console input buffer.
 static void
 cons_intr(int (*proc)(void))
 {
-	int c;
+	int c, n = 0;
 
+	spin_lock(&cons_lock);
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
 			continue;
 		cons.buf[cons.wpos++] = c;
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
+		n++;
+	}
+	spin_unlock(&cons_lock);
+
+	if (n > 0) {
+		spin_lock(&cons_waitq.wq_lock);
+		waitq_wake_all(&cons_waitq);
+		spin_unlock(&cons_waitq.wq_lock);
 	}
 }
 
@@ -427,13 +446,40 @@ cons_getc(void)
 	kbd_intr();
 
 	// grab the next character from the input buffer.
+	c = 0;
+	spin_lock(&cons_lock);
 	if (cons.rpos != cons.wpos) {
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
+	}
+	spin_unlock(&cons_lock);
+	return c;
+}
+
+// Like cons_getc, but if no character is waiting, put curenv to sleep
+// until the keyboard or serial interrupt brings one; curenv then
+// returns 0 and should try again.
+int
+cons_getc_wait(void)
+{
+	bool empty;
+	int c;
+
+	if ((c = cons_getc()) != 0)
 		return c;
+
+	// cons_intr adds input before it takes cons_waitq's lock, so
+	// checking again under that lock closes the race with it.
+	spin_lock(&cons_waitq.wq_lock);
+	spin_lock(&cons_lock);
+	empty = (cons.rpos == cons.wpos);
+	spin_unlock(&cons_lock);
+	if (!empty) {
+		spin_unlock(&cons_waitq.wq_lock);
+		return 0;
 	}
-	return 0;
+	waitq_sleep(&cons_waitq, 0);
 }
 
 // output a character to the console
@@ -449,6 +495,9 @@ cons_putc(int c)
 void
 cons_init(void)
 {
+	spin_initlock(&cons_lock);
+	spin_initlock(&cons_out_lock);
+	waitq_init(&cons_waitq);
 	cga_init();
 	kbd_init();
 	serial_init();
@@ -460,6 +509,27 @@ cons_init(void)
 
 // `High'-level console I/O.  Used by readline and cprintf.
 
+// Acquire cons_out_lock, unless the kernel has panicked: the holder
+// may be the CPU that panicked, or a CPU that has since halted.
+// Returns whether the lock was taken, and so must be released with
+// cons_unlock_output.
+bool
+cons_lock_output(void)
+{
+	extern const char *panicstr;
+
+	if (panicstr)
+		return 0;
+	spin_lock(&cons_out_lock);
+	return 1;
+}
+
+void
+cons_unlock_output(void)
+{
+	spin_unlock(&cons_out_lock);
+}
+
 void
 cputchar(int c)
 {
@@ -471,8 +541,10 @@ getchar(void)
 {
 	int c;
 
+	// Keep answering TLB shootdowns while we wait, since interrupts
+	// are off in the kernel (e.g. in the monitor).
 	while ((c = cons_getc()) == 0)
-		/* do nothing */;
+		tlb_shootdown_poll();
 	return c;
 }
 
@@ -19,6 +19,9 @@
 
 void cons_init(void);
 int cons_getc(void);
+int cons_getc_wait(void);
+bool cons_lock_output(void);
+void cons_unlock_output(void);
 
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
@@ -22,6 +22,9 @@ struct CpuInfo {
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
+	pde_t *cpu_pgdir;               // The page directory loaded in %cr3
+	struct Trapframe *cpu_tf;       // curenv's registers on the kernel
+					// stack, if not yet in env_tf
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
 };
 
@@ -42,5 +45,6 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
 
 #endif
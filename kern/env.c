@@ -14,10 +14,20 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/waitq.h>
+#include <kern/ipc.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
+static struct spinlock env_free_lock;	// Protects env_free_list
+
+// Envs waiting in env_wait.  Its lock also protects every env's
+// env_nchildren and env_exited.
+static struct WaitQueue env_exit_waitq;
+
+struct spinlock env_locks[NENV];
+struct spinlock env_vm_locks[NENV];
 
 #define ENVGENSHIFT	12		// >= LOGNENV
 
@@ -108,6 +118,54 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+//
+// Like envid2env, but also acquires env_lock(*env_store), then makes sure
+// that the Env slot still holds the environment named by envid: it may
+// have been freed, or freed and reused, while we waited for the lock.
+// On success the caller must release env_lock(*env_store).
+//
+int
+envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, checkperm)) < 0)
+		return r;
+	envid = envid ? envid : e->env_id;
+	spin_lock(env_lock(e));
+	if (e->env_id != envid || e->env_status == ENV_FREE) {
+		spin_unlock(env_lock(e));
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
+	*env_store = e;
+	return 0;
+}
+
+//
+// Like envid2env_lock, but acquires env_vm_lock(*env_store), after
+// which (*env_store)->env_pgdir may be used and changed.
+//
+int
+envid2env_vm_lock(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, checkperm)) < 0)
+		return r;
+	envid = envid ? envid : e->env_id;
+	spin_lock(env_vm_lock(e));
+	if (e->env_id != envid || !e->env_pgdir) {
+		spin_unlock(env_vm_lock(e));
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
+	*env_store = e;
+	return 0;
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -119,10 +177,21 @@ env_init(void)
 {
 	// Set up envs array
 	// LAB 3: Your code here.
+	spin_initlock(&env_free_lock);
+	waitq_init(&env_exit_waitq);
 	env_free_list = NULL;
+	// lockstat reports locks initialized one after another under one
+	// name as a single line, so initialize each array in a run of its
+	// own.
+	for (int i = 0; i < NENV; i++)
+		spin_initlock(&env_locks[i]);
+	for (int i = 0; i < NENV; i++)
+		spin_initlock(&env_vm_locks[i]);
 	for(int i = NENV - 1;i >= 0;i--)
 	{
 		envs[i].env_id = 0;
+		envs[i].env_rq_cpu = -1;
+		envs[i].env_oncpu = -1;
 		envs[i].env_link = env_free_list;
 		env_free_list = &envs[i];
 	}
@@ -188,7 +257,7 @@ env_setup_vm(struct Env *e)
 	//    - The functions in kern/pmap.h are handy.
 
 	// LAB 3: Your code here.
-	p->pp_ref++;
+	page_incref(p);
 	e->env_pgdir = page2kva(p);
 	memcpy(e->env_pgdir, kern_pgdir, PGSIZE);
 	// UVPT maps the env's own page table read-only.
@@ -198,9 +267,37 @@ env_setup_vm(struct Env *e)
 	return 0;
 }
 
+//
+// The parent of e, or NULL if it has been freed.
+// Called with env_exit_waitq's lock held.
+//
+static struct Env *
+env_parent(struct Env *e)
+{
+	struct Env *p;
+
+	if (e->env_parent_id == 0)
+		return NULL;
+	p = &envs[ENVX(e->env_parent_id)];
+	if (p->env_id != e->env_parent_id || p->env_status == ENV_FREE)
+		return NULL;
+	return p;
+}
+
+// Remove entry 'i' from p->env_exited.
+static void
+env_forget_exit(struct Env *p, int i)
+{
+	p->env_nexited--;
+	memmove(&p->env_exited[i], &p->env_exited[i + 1],
+		(p->env_nexited - i) * sizeof(p->env_exited[0]));
+}
+
 //
 // Allocates and initializes a new environment.
 // On success, the new environment is stored in *newenv_store.
+// The new environment is ENV_NOT_RUNNABLE, so that no other CPU can
+// pick it up before the caller has finished setting it up.
 //
 // Returns 0 on success, < 0 on failure.  Errors include:
 //	-E_NO_FREE_ENV if all NENVS environments are allocated
@@ -211,14 +308,24 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 {
 	int32_t generation;
 	int r;
-	struct Env *e;
+	struct Env *e, *parent;
 
-	if (!(e = env_free_list))
+	spin_lock(&env_free_lock);
+	if (!(e = env_free_list)) {
+		spin_unlock(&env_free_lock);
 		return -E_NO_FREE_ENV;
+	}
+	env_free_list = e->env_link;
+	spin_unlock(&env_free_lock);
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e)) < 0) {
+		spin_lock(&env_free_lock);
+		e->env_link = env_free_list;
+		env_free_list = e;
+		spin_unlock(&env_free_lock);
 		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -229,8 +336,11 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
+	e->env_status = ENV_NOT_RUNNABLE;
 	e->env_runs = 0;
+	e->env_cpunum = -1;
+	e->env_oncpu = -1;
+	e->env_stop_tsc = 0;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -261,9 +371,24 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
+	e->env_ipc_nfrom = 0;
+	e->env_ipc_callee = 0;
+	e->env_ipc_callno = 0;
+	e->env_ipc_qhead = e->env_ipc_qtail = NULL;
+	e->env_ipc_queued = e->env_ipc_qmax = e->env_ipc_drops = 0;
+
+	// The environment sets up its own system call ring, if any.
+	e->env_ring = NULL;
+	e->env_waitq = NULL;
+
+	// Count e among its parent's children.
+	spin_lock(&env_exit_waitq.wq_lock);
+	e->env_nchildren = 0;
+	e->env_nexited = 0;
+	if ((parent = env_parent(e)))
+		parent->env_nchildren++;
+	spin_unlock(&env_exit_waitq.wq_lock);
 
-	// commit the allocation
-	env_free_list = e->env_link;
 	*newenv_store = e;
 
 	// cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -362,7 +487,7 @@ load_icode(struct Env *e, uint8_t *binary)
 		panic("bad");
 	ph = (struct Proghdr *) (binary + ELFHDR->e_phoff);
 	eph = ph + ELFHDR->e_phnum;
-	lcr3(PADDR(e->env_pgdir));
+	load_pgdir(e->env_pgdir);
 	for (; ph < eph; ph++)
 		if (ph->p_type == ELF_PROG_LOAD)
 		{
@@ -376,7 +501,7 @@ load_icode(struct Env *e, uint8_t *binary)
 	
 	// LAB 3: Your code here.
 	region_alloc(e, (void*)USTACKTOP - PGSIZE, PGSIZE);
-	lcr3(PADDR(kern_pgdir));
+	load_pgdir(kern_pgdir);
 }
 
 //
@@ -403,28 +528,120 @@ env_create(uint8_t *binary, enum EnvType type)
 	e->env_type = type;
 	if (type == ENV_TYPE_FS)
 		e->env_tf.tf_eflags |= FL_IOPL_MASK;
+
+	// Make the new environment visible to the scheduler.
+	spin_lock(env_lock(e));
+	e->env_status = ENV_RUNNABLE;
+	sched_enqueue(e);
+	spin_unlock(env_lock(e));
+}
+
+//
+// Wait for environment 'envid' to be freed, or, if envid is 0, for any
+// child of curenv.  A child that exits before its parent asks is
+// remembered, up to ENV_EXITED_MAX of them.
+//
+// Returns the envid of the freed environment, or 0 after curenv has
+// slept (possibly spuriously) and should ask again, or -E_BAD_ENV if
+// waiting for any child and curenv has none left.
+//
+int
+env_wait(envid_t envid)
+{
+	struct Env *e;
+	int i;
+
+	spin_lock(&env_exit_waitq.wq_lock);
+	if (envid == 0) {
+		if (curenv->env_nexited > 0) {
+			envid = curenv->env_exited[0];
+			env_forget_exit(curenv, 0);
+		} else if (curenv->env_nchildren == 0)
+			envid = -E_BAD_ENV;
+		else
+			waitq_sleep(&env_exit_waitq, curenv->env_id);
+		spin_unlock(&env_exit_waitq.wq_lock);
+		return envid;
+	}
+
+	e = &envs[ENVX(envid)];
+	if (e->env_id == envid && e->env_status != ENV_FREE)
+		waitq_sleep(&env_exit_waitq, envid);
+	// Don't report e again to a wait for any child.
+	for (i = 0; i < curenv->env_nexited; i++)
+		if (curenv->env_exited[i] == envid) {
+			env_forget_exit(curenv, i);
+			break;
+		}
+	spin_unlock(&env_exit_waitq.wq_lock);
+	return envid;
+}
+
+//
+// e is being freed and will never send another message.  Take it out of
+// the sender sets of environments blocked receiving, and fail the
+// receive of any that were waiting only for e, such as a sys_ipc_call
+// to e.
+//
+static void
+env_abort_receivers(struct Env *e)
+{
+	struct Env *c;
+	bool removed;
+	int i;
+
+	for (c = envs; c < envs + NENV; c++) {
+		if (!c->env_ipc_recving || c->env_ipc_nfrom == 0)
+			continue;
+		spin_lock(env_lock(c));
+		removed = false;
+		for (i = 0; c->env_ipc_recving && i < c->env_ipc_nfrom; i++)
+			if (c->env_ipc_from_set[i] == e->env_id) {
+				c->env_ipc_from_set[i--] =
+					c->env_ipc_from_set[--c->env_ipc_nfrom];
+				removed = true;
+			}
+		if (removed && c->env_ipc_nfrom == 0
+		    && c->env_status == ENV_NOT_RUNNABLE) {
+			c->env_ipc_recving = 0;
+			c->env_ipc_callee = 0;
+			c->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+			c->env_status = ENV_RUNNABLE;
+			sched_enqueue(c);
+		}
+		spin_unlock(env_lock(c));
+	}
 }
 
 //
 // Frees env e and all memory it uses.
+// e must not be loaded on any CPU other than this one; see env_destroy.
 //
 void
 env_free(struct Env *e)
 {
+	struct Env *parent;
 	pte_t *pt;
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
+	struct tlb_batch tb;
 
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
 	// gets reused.
 	if (e == curenv)
-		lcr3(PADDR(kern_pgdir));
+		load_pgdir(kern_pgdir);
 
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
+	// A dying env no longer sleeps on anything.
+	waitq_cancel(e);
+
+	// Flush all mapped pages in the user portion of the address space.
+	// Other environments may still be trying to map pages into e.
+	spin_lock(env_vm_lock(e));
+	tlb_batch_init(&tb, e->env_pgdir);
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
 
@@ -432,6 +649,10 @@ env_free(struct Env *e)
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
+		// a page table still shared since fork just loses a reference
+		if (pgdir_drop_shared(&e->env_pgdir[pdeno]))
+			continue;
+
 		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
@@ -439,10 +660,12 @@ env_free(struct Env *e)
 		// unmap all PTEs in this page table
 		for (pteno = 0; pteno <= PTX(~0); pteno++) {
 			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
+				page_remove_batch(e->env_pgdir,
+						  PGADDR(pdeno, pteno, 0), &tb);
 		}
 
 		// free the page table itself
+		tlb_batch_flush(&tb);
 		e->env_pgdir[pdeno] = 0;
 		page_decref(pa2page(pa));
 	}
@@ -451,11 +674,47 @@ env_free(struct Env *e)
 	pa = PADDR(e->env_pgdir);
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
+	if (e->env_ring) {
+		page_decref(e->env_ring);
+		e->env_ring = NULL;
+	}
+	spin_unlock(env_vm_lock(e));
 
 	// return the environment to the free list
+	spin_lock(env_lock(e));
+	sched_dequeue(e);
 	e->env_status = ENV_FREE;
+	e->env_oncpu = -1;
+	e->env_ipc_recving = 0;
+	e->env_ipc_callee = 0;
+	// Nobody will receive the messages still queued for e.
+	ipcq_flush(e);
+	spin_unlock(env_lock(e));
+	env_abort_receivers(e);
+
+	// Tell e's parent, and wake whoever waits in env_wait for e or
+	// for any child of e's parent.
+	spin_lock(&env_exit_waitq.wq_lock);
+	if ((parent = env_parent(e))) {
+		parent->env_nchildren--;
+		if (parent->env_nexited == ENV_EXITED_MAX)
+			env_forget_exit(parent, 0);
+		parent->env_exited[parent->env_nexited++] = e->env_id;
+	}
+	waitq_wake(&env_exit_waitq, e->env_id, NENV);
+	if (e->env_parent_id)
+		waitq_wake(&env_exit_waitq, e->env_parent_id, NENV);
+	spin_unlock(&env_exit_waitq.wq_lock);
+
+	// Whoever sleeps on a futex may be waiting for e: in ipc_send to
+	// e, or on a pipe e just let go of.  Wake them all to check again;
+	// this is rare enough that precision does not pay.
+	futex_wake_all();
+
+	spin_lock(&env_free_lock);
 	e->env_link = env_free_list;
 	env_free_list = e;
+	spin_unlock(&env_free_lock);
 }
 
 //
@@ -466,14 +725,34 @@ env_free(struct Env *e)
 void
 env_destroy(struct Env *e)
 {
-	// If e is currently running on other CPUs, we change its state to
-	// ENV_DYING. A zombie environment will be freed the next time
-	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+	spin_lock(env_lock(e));
+	env_destroy_locked(e);
+}
+
+//
+// Like env_destroy, but the caller already holds env_lock(e), which
+// this releases.
+//
+void
+env_destroy_locked(struct Env *e)
+{
+	int cpu = e->env_oncpu;
+
+	// Somebody else is already tearing e down.
+	if (e->env_status == ENV_FREE || e->env_status == ENV_DYING) {
+		spin_unlock(env_lock(e));
 		return;
 	}
 
+	// If e is currently loaded on another CPU, we change its state to
+	// ENV_DYING.  That CPU will free the zombie when it next enters
+	// the kernel for e or switches away from it (see env_leave).
+	sched_dequeue(e);
+	e->env_status = ENV_DYING;
+	spin_unlock(env_lock(e));
+	if (cpu >= 0 && cpu != cpunum())
+		return;
+
 	env_free(e);
 
 	if (curenv == e) {
@@ -482,6 +761,62 @@ env_destroy(struct Env *e)
 	}
 }
 
+//
+// Stop using curenv's address space on this CPU and hand curenv back
+// to the scheduler: requeue it if it is still runnable, or free it if
+// it was destroyed while it was loaded here.  Afterwards curenv is
+// NULL and this CPU runs on kern_pgdir.
+//
+void
+env_leave(void)
+{
+	struct Env *e = curenv;
+	bool dying;
+
+	env_save_tf();
+	load_pgdir(kern_pgdir);
+	curenv = NULL;
+	if (!e)
+		return;
+
+	e->env_stop_tsc = read_tsc();
+	spin_lock(env_lock(e));
+	e->env_oncpu = -1;
+	if (e->env_status == ENV_RUNNING) {
+		e->env_status = ENV_RUNNABLE;
+		sched_enqueue(e);
+	}
+	dying = (e->env_status == ENV_DYING);
+	spin_unlock(env_lock(e));
+
+	if (dying)
+		env_free(e);
+}
+
+
+//
+// trap() leaves curenv's trap frame on the kernel stack, so that going
+// back to curenv does not have to copy it anywhere.  Copy it into
+// curenv->env_tf now, because curenv is about to leave this CPU, block,
+// or be resumed from env_tf.  Code that makes curenv wait for someone
+// else to change its env_tf must call this first.
+//
+void
+env_save_tf(void)
+{
+	if (thiscpu->cpu_tf && curenv)
+		curenv->env_tf = *thiscpu->cpu_tf;
+	thiscpu->cpu_tf = NULL;
+}
+
+//
+// Return curenv's registers as of its entry into the kernel.
+//
+struct Trapframe *
+env_cur_tf(void)
+{
+	return thiscpu->cpu_tf ? thiscpu->cpu_tf : &curenv->env_tf;
+}
 
 //
 // Restores the register values in the Trapframe with the 'iret' instruction.
@@ -510,10 +845,12 @@ env_pop_tf(struct Trapframe *tf)
 // Context switch from curenv to env e.
 // Note: if this is the first call to env_run, curenv is NULL.
 //
-// This function does not return.
+// Returns -E_BAD_ENV, having left curenv if e is another environment,
+// only if e is no longer runnable: another CPU destroyed, blocked or
+// ran it after it was picked.  Otherwise does not return.
 //
-void
-env_run(struct Env *e)
+int
+env_try_run(struct Env *e)
 {
 	// Step 1: If this is a context switch (a new environment is running):
 	//	   1. Set the current environment (if any) back to
@@ -533,19 +870,54 @@ env_run(struct Env *e)
 	//	e->env_tf to sensible values.
 
 	// LAB 3: Your code here.
-	//if (curenv != e)
-	{
-		if (curenv && curenv->env_status == ENV_RUNNING)
-		{
-			curenv->env_status = ENV_RUNNABLE;
+	env_save_tf();
+	if (curenv && curenv != e)
+		env_leave();
+
+	// e may have been picked off a run queue just before another CPU
+	// destroyed or ran it; check under e's lock that it is still ours
+	// to run.  A runnable e may also still be loaded on the CPU that
+	// last ran it, so wait for that CPU to switch away from e.  That
+	// CPU never waits on us: env_leave has already released curenv.
+	for (;;) {
+		spin_lock(env_lock(e));
+		if (e->env_status != ENV_RUNNABLE
+		    && !(e == curenv && e->env_status == ENV_RUNNING)) {
+			spin_unlock(env_lock(e));
+			return -E_BAD_ENV;
+		}
+		if (e->env_oncpu < 0 || e->env_oncpu == cpunum())
+			break;
+		spin_unlock(env_lock(e));
+		while (e->env_oncpu >= 0) {
+			tlb_shootdown_poll();
+			asm volatile("pause" ::: "memory");
 		}
-		curenv = e;
-		curenv->env_status = ENV_RUNNING;
-		curenv->env_runs++;
 	}
-	lcr3(PADDR(curenv->env_pgdir));
-	spin_unlock(&kernel_lock);
+	// e may have been picked straight off a run queue, or be
+	// switched to directly; either way it must not stay queued.
+	sched_dequeue(e);
+	e->env_status = ENV_RUNNING;
+	e->env_oncpu = cpunum();
+	spin_unlock(env_lock(e));
+
+	curenv = e;
+	curenv->env_runs++;
+	load_pgdir(curenv->env_pgdir);
 	env_pop_tf(&curenv->env_tf);
 	panic("env_run not yet implemented");
 }
 
+//
+// Run e, or if it is no longer runnable, whatever the scheduler picks
+// instead.
+//
+// This function does not return.
+//
+void
+env_run(struct Env *e)
+{
+	env_try_run(e);
+	sched_yield();
+}
+
@@ -5,19 +5,53 @@
 
 #include <inc/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 extern struct Env *envs;		// All environments
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
+// Per-environment locks, kept beside envs[] rather than in struct Env
+// because envs[] is mapped read-only into every user environment.
+//
+// env_lock(e) protects e's env_status, env_oncpu, run queue membership
+// and IPC fields.  env_vm_lock(e) protects e's address space: the
+// mappings below UTOP in e->env_pgdir and env_pgdir itself.  When more
+// than one lock is needed, take them in the order
+//	env_vm_lock -> wait queue lock -> env_lock -> run queue lock
+//	    -> pt_share_lock -> page allocator lock;
+// two locks of the same kind are taken in envs[] order.
+extern struct spinlock env_locks[NENV];
+extern struct spinlock env_vm_locks[NENV];
+
+static inline struct spinlock *
+env_lock(struct Env *e)
+{
+	return &env_locks[e - envs];
+}
+
+static inline struct spinlock *
+env_vm_lock(struct Env *e)
+{
+	return &env_vm_locks[e - envs];
+}
+
 void	env_init(void);
 void	env_init_percpu(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_destroy_locked(struct Env *e);	// Same, called with env_lock(e)
+void	env_leave(void);
+int	env_wait(envid_t envid);
+void	env_save_tf(void);
+struct Trapframe *env_cur_tf(void);
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+int	envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm);
+int	envid2env_vm_lock(envid_t envid, struct Env **env_store, bool checkperm);
+int	env_try_run(struct Env *e);
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
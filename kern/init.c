@@ -14,6 +14,8 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/waitq.h>
+#include <kern/ipc.h>
 
 static void boot_aps(void);
 
@@ -39,6 +41,9 @@ i386_init(void)
 
 	// Lab 3 user environment initialization functions
 	env_init();
+	sched_init();
+	futex_init();
+	ipc_init();
 	trap_init();
 
 	// Lab 4 multiprocessor initialization functions
@@ -48,12 +53,6 @@ i386_init(void)
 	// Lab 4 multitasking initialization functions
 	pic_init();
 
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-	spin_lock(&kernel_lock);
-	// Starting non-boot CPUs
-	boot_aps();
-
 	// Start fs.
 	ENV_CREATE(fs_fs, ENV_TYPE_FS);
 
@@ -68,6 +67,11 @@ i386_init(void)
 	// Should not be necessary - drains keyboard because interrupt has given up.
 	kbd_intr();
 
+	// Starting non-boot CPUs.  There is no big kernel lock to hold
+	// them off, so do this only once the initial environments exist
+	// and the APs have something to schedule.
+	boot_aps();
+
 	// Schedule and run the first user environment!
 	sched_yield();
 }
@@ -109,7 +113,7 @@ void
 mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
-	lcr3(PADDR(kern_pgdir));
+	load_pgdir(kern_pgdir);
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
@@ -118,11 +122,8 @@ mp_main(void)
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
-	spin_lock(&kernel_lock);
+	// to start running processes on this CPU.  The scheduler does its
+	// own locking, so several CPUs may be in it at once.
 	sched_yield();
 	// Remove this after you finish Exercise 4
 	for (;;);
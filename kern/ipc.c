@@ -0,0 +1,162 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/error.h>
+#include <inc/assert.h>
+#include <inc/stdio.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/kmem.h>
+#include <kern/ipc.h>
+
+// Queued messages come from a slab cache, so sending to a busy
+// environment costs no page allocation.
+static struct kmem_cache *ipc_msg_cache;
+
+void
+ipc_init(void)
+{
+	ipc_msg_cache = kmem_cache_create("ipc_msg", sizeof(struct IpcMsg),
+					  sizeof(void *), NULL);
+	assert(ipc_msg_cache);
+}
+
+//
+// Whether e, which is receiving or about to, takes messages from the
+// environment 'from': e's sender set is empty or names 'from'.
+//
+bool
+ipc_accepts(struct Env *e, envid_t from)
+{
+	int i;
+
+	if (e->env_ipc_nfrom == 0)
+		return true;
+	for (i = 0; i < e->env_ipc_nfrom; i++)
+		if (e->env_ipc_from_set[i] == from)
+			return true;
+	return false;
+}
+
+//
+// Append a copy of 'msg' to e's queue, taking a reference to each of
+// the pages it grants.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if e is being destroyed.
+//	-E_IPC_NOT_RECV if e already has ENV_IPCQ_MAX messages queued;
+//		this counts as a drop in e->env_ipc_drops.
+//	-E_NO_MEM if there is no memory for the message.
+//
+int
+ipcq_push(struct Env *e, const struct IpcMsg *msg)
+{
+	struct IpcMsg *m;
+	struct PageInfo *arr;
+	int i;
+
+	if (e->env_status == ENV_DYING || e->env_status == ENV_FREE)
+		return -E_BAD_ENV;
+	if (e->env_ipc_queued >= ENV_IPCQ_MAX) {
+		e->env_ipc_drops++;
+		return -E_IPC_NOT_RECV;
+	}
+	if (!(m = kmem_cache_alloc(ipc_msg_cache)))
+		return -E_NO_MEM;
+	*m = *msg;
+	m->im_pages = &m->im_page;
+	if (msg->im_npages > 1) {
+		if (!(arr = page_alloc(0))) {
+			kmem_cache_free(ipc_msg_cache, m);
+			return -E_NO_MEM;
+		}
+		m->im_pages = page2kva(arr);
+	}
+	m->im_next = NULL;
+	for (i = 0; i < msg->im_npages; i++) {
+		m->im_pages[i] = msg->im_pages[i];
+		page_incref(m->im_pages[i]);
+	}
+
+	if (e->env_ipc_qtail)
+		e->env_ipc_qtail->im_next = m;
+	else
+		e->env_ipc_qhead = m;
+	e->env_ipc_qtail = m;
+	if (++e->env_ipc_queued > e->env_ipc_qmax)
+		e->env_ipc_qmax = e->env_ipc_queued;
+	return 0;
+}
+
+//
+// Remove and return the oldest message queued for e from a sender e
+// accepts (see ipc_accepts), or NULL if there is none.  The caller
+// frees it with ipcq_free.
+//
+struct IpcMsg *
+ipcq_pop(struct Env *e)
+{
+	struct IpcMsg *m, *prev = NULL;
+
+	for (m = e->env_ipc_qhead; m; prev = m, m = m->im_next)
+		if (ipc_accepts(e, m->im_from))
+			break;
+	if (!m)
+		return NULL;
+	if (prev)
+		prev->im_next = m->im_next;
+	else
+		e->env_ipc_qhead = m->im_next;
+	if (e->env_ipc_qtail == m)
+		e->env_ipc_qtail = prev;
+	e->env_ipc_queued--;
+	return m;
+}
+
+//
+// Throw away every message queued for e.
+//
+void
+ipcq_flush(struct Env *e)
+{
+	struct IpcMsg *m;
+
+	while ((m = e->env_ipc_qhead)) {
+		e->env_ipc_qhead = m->im_next;
+		ipcq_free(m);
+	}
+	e->env_ipc_qtail = NULL;
+	e->env_ipc_queued = 0;
+}
+
+//
+// Free a message, dropping its references to the pages it granted.
+//
+void
+ipcq_free(struct IpcMsg *m)
+{
+	int i;
+
+	for (i = 0; i < m->im_npages; i++)
+		page_decref(m->im_pages[i]);
+	if (m->im_pages != &m->im_page)
+		page_free(pa2page(PADDR(m->im_pages)));
+	kmem_cache_free(ipc_msg_cache, m);
+}
+
+//
+// Print the IPC queue statistics of every environment that has ever
+// had a message queued.
+//
+void
+ipc_print_stats(void)
+{
+	struct Env *e;
+
+	cprintf("env       queued  max  drops\n");
+	for (e = envs; e < envs + NENV; e++)
+		if (e->env_status != ENV_FREE && e->env_ipc_qmax)
+			cprintf("%08x  %6u  %3u  %5u\n", e->env_id,
+				e->env_ipc_queued, e->env_ipc_qmax,
+				e->env_ipc_drops);
+}
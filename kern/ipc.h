@@ -0,0 +1,38 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_IPC_H
+#define JOS_KERN_IPC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/env.h>
+
+struct PageInfo;
+
+// A message sent to an environment that was not receiving, waiting in
+// its queue (env_ipc_qhead) for the next sys_ipc_recv.  Granted pages
+// are held by references of their own until then.
+struct IpcMsg {
+	struct IpcMsg *im_next;
+	envid_t im_from;
+	uint32_t im_value;
+	uint32_t im_handle;		// Reply handle if sent by sys_ipc_call
+	int im_perm;
+	int im_npages;			// Pages granted with the message
+	struct PageInfo **im_pages;	// The pages: &im_page, or a page of
+					// pointers if there is more than one
+	struct PageInfo *im_page;
+};
+
+void	ipc_init(void);
+// These four are called with env_lock(e) held.
+bool	ipc_accepts(struct Env *e, envid_t from);
+int	ipcq_push(struct Env *e, const struct IpcMsg *msg);
+struct IpcMsg *ipcq_pop(struct Env *e);
+void	ipcq_flush(struct Env *e);
+void	ipcq_free(struct IpcMsg *m);
+void	ipc_print_stats(void);
+
+#endif	// !JOS_KERN_IPC_H
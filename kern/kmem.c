@@ -0,0 +1,391 @@
+// Slab allocator for fixed-size kernel objects.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/mmu.h>
+
+#include <kern/kmem.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+#define KMEM_CPU_SIZE	16	// Most free objects a CPU keeps per cache
+#define KMEM_CPU_BATCH	8	// Objects moved per refill or drain
+
+// A slab is one page of objects.  Its header sits at the end of the
+// page, so an object's slab can be found from the object's address.
+// Each object is followed by a link word that chains the slab's free
+// objects together without overwriting their constructed state.
+struct kmem_slab {
+	struct kmem_slab *sl_next;	// Next/previous slab on the same
+	struct kmem_slab *sl_prev;	// list of the cache
+	void *sl_free;			// First free object
+	int sl_inuse;			// Objects allocated from this slab
+};
+
+// Free objects of a cache that belong to one CPU.  Only that CPU touches
+// them, and the kernel runs with interrupts disabled, so they need no
+// lock.
+struct kmem_cpu_cache {
+	void *cc_objs[KMEM_CPU_SIZE];
+	int cc_count;
+};
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			// Object size, as requested
+	size_t kc_stride;		// Distance between objects in a slab
+	size_t kc_link;			// Offset of the free link in an object
+	int kc_nobjs;			// Objects per slab
+	void (*kc_ctor)(void *);
+
+	struct spinlock kc_lock;	// Protects the slab lists
+	struct kmem_slab *kc_partial;	// Slabs with free and used objects
+	struct kmem_slab *kc_full;	// Slabs with no free objects
+	struct kmem_slab *kc_empty;	// Slabs with no used objects
+	int kc_nslabs;
+
+	struct kmem_cpu_cache kc_cpu[NCPU];
+};
+
+// The cache that kmem_cache_create allocates caches from.
+static struct kmem_cache kmem_cache_cache;
+
+#define OBJ_SLAB(obj) \
+	((struct kmem_slab *) (ROUNDDOWN((uintptr_t) (obj), PGSIZE) \
+			       + PGSIZE - sizeof(struct kmem_slab)))
+#define OBJ_LINK(cp, obj)	(*(void **) ((char *) (obj) + (cp)->kc_link))
+
+static void
+kmem_cache_setup(struct kmem_cache *cp, const char *name, size_t size,
+		 size_t align, void (*ctor)(void *))
+{
+	if (align == 0)
+		align = sizeof(void *);
+	if (align & (align - 1))
+		panic("kmem_cache_create %s: alignment %d is not a power of 2",
+		      name, align);
+	memset(cp, 0, sizeof(*cp));
+	cp->kc_name = name;
+	cp->kc_size = size;
+	cp->kc_link = ROUNDUP(size, sizeof(void *));
+	cp->kc_stride = ROUNDUP(cp->kc_link + sizeof(void *), align);
+	if (cp->kc_stride > PGSIZE - sizeof(struct kmem_slab))
+		panic("kmem_cache_create %s: objects of %d bytes are too big",
+		      name, size);
+	cp->kc_nobjs = (PGSIZE - sizeof(struct kmem_slab)) / cp->kc_stride;
+	cp->kc_ctor = ctor;
+	spin_initlock(&cp->kc_lock);
+}
+
+void
+kmem_init(void)
+{
+	kmem_cache_setup(&kmem_cache_cache, "kmem_cache",
+			 sizeof(struct kmem_cache), 0, NULL);
+}
+
+//
+// Create a cache of objects of 'size' bytes, each aligned to 'align'
+// bytes (a power of 2; 0 means word alignment).  If 'ctor' is not NULL,
+// it is called on each object when the object is first created.
+//
+// Returns NULL if out of memory.  Panics if the objects do not fit in
+// a page.
+//
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align,
+		  void (*ctor)(void *))
+{
+	struct kmem_cache *cp;
+
+	if (!(cp = kmem_cache_alloc(&kmem_cache_cache)))
+		return NULL;
+	kmem_cache_setup(cp, name, size, align, ctor);
+	return cp;
+}
+
+// Slab lists.  The caller must hold cp->kc_lock.
+static void
+slab_push(struct kmem_slab **list, struct kmem_slab *sp)
+{
+	sp->sl_prev = NULL;
+	sp->sl_next = *list;
+	if (sp->sl_next)
+		sp->sl_next->sl_prev = sp;
+	*list = sp;
+}
+
+static void
+slab_unlink(struct kmem_slab **list, struct kmem_slab *sp)
+{
+	if (sp->sl_prev)
+		sp->sl_prev->sl_next = sp->sl_next;
+	else
+		*list = sp->sl_next;
+	if (sp->sl_next)
+		sp->sl_next->sl_prev = sp->sl_prev;
+	sp->sl_next = sp->sl_prev = NULL;
+}
+
+// Allocate a page and carve it into constructed free objects.
+// Called without cp->kc_lock, so that constructors run unlocked.
+static struct kmem_slab *
+slab_create(struct kmem_cache *cp)
+{
+	struct PageInfo *pp;
+	struct kmem_slab *sp;
+	char *obj;
+	int i;
+
+	if (!(pp = page_alloc(0)))
+		return NULL;
+	page_incref(pp);
+	sp = OBJ_SLAB(page2kva(pp));
+	sp->sl_next = sp->sl_prev = NULL;
+	sp->sl_free = NULL;
+	sp->sl_inuse = 0;
+	for (i = cp->kc_nobjs - 1; i >= 0; i--) {
+		obj = (char *) page2kva(pp) + i * cp->kc_stride;
+		if (cp->kc_ctor)
+			cp->kc_ctor(obj);
+		OBJ_LINK(cp, obj) = sp->sl_free;
+		sp->sl_free = obj;
+	}
+	return sp;
+}
+
+// Take a free object from the cache's slabs, growing the cache if
+// necessary.  The caller must hold cp->kc_lock; it may be dropped and
+// reacquired.
+static void *
+slab_alloc(struct kmem_cache *cp)
+{
+	struct kmem_slab *sp;
+	void *obj;
+
+	if ((sp = cp->kc_partial))
+		slab_unlink(&cp->kc_partial, sp);
+	else if ((sp = cp->kc_empty))
+		slab_unlink(&cp->kc_empty, sp);
+	else {
+		spin_unlock(&cp->kc_lock);
+		sp = slab_create(cp);
+		spin_lock(&cp->kc_lock);
+		if (!sp)
+			return NULL;
+		cp->kc_nslabs++;
+	}
+	obj = sp->sl_free;
+	sp->sl_free = OBJ_LINK(cp, obj);
+	if (++sp->sl_inuse == cp->kc_nobjs)
+		slab_push(&cp->kc_full, sp);
+	else
+		slab_push(&cp->kc_partial, sp);
+	return obj;
+}
+
+// Return an object to its slab.  The caller must hold cp->kc_lock.
+static void
+slab_free(struct kmem_cache *cp, void *obj)
+{
+	struct kmem_slab *sp = OBJ_SLAB(obj);
+
+	slab_unlink(sp->sl_inuse == cp->kc_nobjs
+		    ? &cp->kc_full : &cp->kc_partial, sp);
+	OBJ_LINK(cp, obj) = sp->sl_free;
+	sp->sl_free = obj;
+	if (--sp->sl_inuse == 0)
+		slab_push(&cp->kc_empty, sp);
+	else
+		slab_push(&cp->kc_partial, sp);
+}
+
+// Give the pages of all but 'keep' empty slabs back to the page
+// allocator.  The caller must hold cp->kc_lock.
+static void
+slab_release_empty(struct kmem_cache *cp, int keep)
+{
+	struct kmem_slab *sp, *next;
+
+	for (sp = cp->kc_empty; sp; sp = next) {
+		next = sp->sl_next;
+		if (keep > 0) {
+			keep--;
+			continue;
+		}
+		slab_unlink(&cp->kc_empty, sp);
+		cp->kc_nslabs--;
+		page_decref(pa2page(PADDR(sp)));
+	}
+}
+
+//
+// Allocate an object from cache 'cp'.  The object is in the state its
+// constructor, or its last user, left it in.
+// Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct kmem_cache *cp)
+{
+	struct kmem_cpu_cache *cc = &cp->kc_cpu[cpunum()];
+	void *obj;
+
+	if (cc->cc_count == 0) {
+		// Refill with a batch from the slabs.
+		spin_lock(&cp->kc_lock);
+		while (cc->cc_count < KMEM_CPU_BATCH
+		       && (obj = slab_alloc(cp)))
+			cc->cc_objs[cc->cc_count++] = obj;
+		spin_unlock(&cp->kc_lock);
+		if (cc->cc_count == 0)
+			return NULL;
+	}
+	return cc->cc_objs[--cc->cc_count];
+}
+
+//
+// Return an object allocated from cache 'cp'.  If the cache has a
+// constructor, the object must be in its constructed state.
+//
+void
+kmem_cache_free(struct kmem_cache *cp, void *obj)
+{
+	struct kmem_cpu_cache *cc = &cp->kc_cpu[cpunum()];
+
+	if (cc->cc_count == KMEM_CPU_SIZE) {
+		// Full: give a batch back to the slabs, and keep at most one
+		// empty slab around for the next allocation.
+		spin_lock(&cp->kc_lock);
+		while (cc->cc_count > KMEM_CPU_SIZE - KMEM_CPU_BATCH)
+			slab_free(cp, cc->cc_objs[--cc->cc_count]);
+		slab_release_empty(cp, 1);
+		spin_unlock(&cp->kc_lock);
+	}
+	cc->cc_objs[cc->cc_count++] = obj;
+}
+
+//
+// Give all the memory that cache 'cp' does not need back to the page
+// allocator: this CPU's free objects and every empty slab.  Free objects
+// held by other CPUs stay where they are.
+//
+void
+kmem_cache_reap(struct kmem_cache *cp)
+{
+	struct kmem_cpu_cache *cc = &cp->kc_cpu[cpunum()];
+
+	spin_lock(&cp->kc_lock);
+	while (cc->cc_count > 0)
+		slab_free(cp, cc->cc_objs[--cc->cc_count]);
+	slab_release_empty(cp, 0);
+	spin_unlock(&cp->kc_lock);
+}
+
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+#define CHECK_NOBJS	1000
+#define CHECK_MAGIC	0x5a5a5a5a
+
+struct check_obj {
+	uint32_t co_magic;		// Set by the constructor
+	uint32_t co_index;		// Set while allocated
+	char co_pad[16];
+};
+
+static void *check_objs[CHECK_NOBJS];
+static int check_nctor;
+
+static void
+check_ctor(void *obj)
+{
+	struct check_obj *co = obj;
+
+	co->co_magic = CHECK_MAGIC;
+	co->co_index = ~0;
+	check_nctor++;
+}
+
+//
+// Stress the slab allocator: fill many slabs, check that objects are
+// distinct, aligned and constructed exactly once, free and reallocate
+// them in a different order, and give all the memory back.
+//
+void
+check_kmem(void)
+{
+	struct kmem_cache *cp;
+	struct check_obj *co;
+	int i, nctor;
+	char *c;
+
+	assert((cp = kmem_cache_create("check_kmem", sizeof(struct check_obj),
+				       0, check_ctor)));
+	for (i = 0; i < CHECK_NOBJS; i++) {
+		assert((co = check_objs[i] = kmem_cache_alloc(cp)));
+		assert((uintptr_t) co % sizeof(void *) == 0);
+		assert(co->co_magic == CHECK_MAGIC && co->co_index == ~0);
+		co->co_index = i;
+	}
+	assert(cp->kc_nslabs >= CHECK_NOBJS / cp->kc_nobjs);
+	assert(check_nctor == cp->kc_nslabs * cp->kc_nobjs);
+
+	// No object was handed out twice
+	for (i = 0; i < CHECK_NOBJS; i++) {
+		co = check_objs[i];
+		assert(co->co_index == i);
+	}
+
+	// Free every other object and take them back: they are reused,
+	// still constructed, without running the constructor again
+	nctor = check_nctor;
+	for (i = 0; i < CHECK_NOBJS; i += 2) {
+		co = check_objs[i];
+		co->co_index = ~0;
+		kmem_cache_free(cp, co);
+	}
+	for (i = 0; i < CHECK_NOBJS; i += 2) {
+		assert((co = check_objs[i] = kmem_cache_alloc(cp)));
+		assert(co->co_magic == CHECK_MAGIC && co->co_index == ~0);
+		co->co_index = i;
+	}
+	assert(check_nctor == nctor);
+	for (i = 0; i < CHECK_NOBJS; i++) {
+		co = check_objs[i];
+		assert(co->co_index == i);
+	}
+
+	// Free everything in reverse order; all slabs go back
+	for (i = CHECK_NOBJS - 1; i >= 0; i--) {
+		co = check_objs[i];
+		co->co_index = ~0;
+		kmem_cache_free(cp, co);
+	}
+	kmem_cache_reap(cp);
+	assert(cp->kc_nslabs == 0);
+	assert(!cp->kc_partial && !cp->kc_full && !cp->kc_empty);
+
+	// Large, aligned objects without a constructor stay within their
+	// page and clear of the slab header
+	assert((cp = kmem_cache_create("check_kmem_aligned", 200, 64, NULL)));
+	for (i = 0; i < 100; i++) {
+		assert((c = check_objs[i] = kmem_cache_alloc(cp)));
+		assert((uintptr_t) c % 64 == 0);
+		assert((uintptr_t) (c + 200) <= (uintptr_t) OBJ_SLAB(c));
+		memset(c, i, 200);
+	}
+	for (i = 0; i < 100; i++) {
+		c = check_objs[i];
+		assert(c[0] == (char) i && c[199] == (char) i);
+		kmem_cache_free(cp, c);
+	}
+	kmem_cache_reap(cp);
+	assert(cp->kc_nslabs == 0);
+
+	cprintf("check_kmem() succeeded!\n");
+}
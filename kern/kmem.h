@@ -0,0 +1,34 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KMEM_H
+#define JOS_KERN_KMEM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Object caches ("slab allocator") for fixed-size kernel objects.
+//
+// A cache hands out objects of one size, carved from whole pages
+// ("slabs") obtained with page_alloc.  If the cache has a constructor,
+// it runs once, when an object's slab is created, and freed objects
+// must be returned to the cache in their constructed state; so
+// allocating an object does not have to initialize it again.
+// Each CPU keeps a few free objects of every cache to itself, so most
+// allocations and frees take no lock.
+
+struct kmem_cache;
+
+void	kmem_init(void);
+
+// Caches are meant to be created during boot and are never destroyed.
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, void (*ctor)(void *));
+void	*kmem_cache_alloc(struct kmem_cache *cp);
+void	kmem_cache_free(struct kmem_cache *cp, void *obj);
+void	kmem_cache_reap(struct kmem_cache *cp);
+
+void	check_kmem(void);
+
+#endif	// !JOS_KERN_KMEM_H
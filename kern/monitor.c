@@ -12,6 +12,9 @@
 #include <kern/kdebug.h>
 #include <kern/trap.h>
 #include <kern/pmap.h>
+#include <kern/spinlock.h>
+#include <kern/cpu.h>
+#include <kern/ipc.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 static bool enable_single_step = false;
@@ -32,6 +35,11 @@ static struct Command commands[] = {
 	{ "lookmem", "Look up some bits/bytes in that virutal/physical address", mon_lookmem},
 	{ "s", "Single step to next instruction", mon_singlestep},
 	{ "c", "Continue execution", mon_continue},
+	{ "lockstat", "Display spinlock contention statistics ('lockstat reset' clears them)", mon_lockstat},
+	{ "buddyinfo", "Display free physical memory by block size", mon_buddyinfo},
+	{ "zeropool", "Display the pre-zeroed page pool and its hit rate", mon_zeropool},
+	{ "ipcstat", "Display IPC message queue depths and drops per environment", mon_ipcstat},
+	{ "tlbbench", "Compare memory access cost through 4KB and 4MB pages", mon_tlbbench},
 	
 };
 
@@ -99,6 +107,15 @@ showmapping(uint32_t pa)
 	pte_t* pg_table = pgdir_walk(kern_pgdir, (void *)pa, 0);
 	if (pg_table == NULL || !(*pg_table & PTE_P)) 
 		cprintf("The page doesn't exist!\n");
+	else if (*pg_table & PTE_PS)
+	{
+		cprintf("0x%08x - 0x%08x (4MB page): ", PTE_ADDR(*pg_table), PTE_ADDR(*pg_table) + PTSIZE - 1);
+		bool user = *pg_table & PTE_U, write = *pg_table & PTE_W;
+		if (user) cprintf("user: ");
+		else cprintf("kernel: ");
+		if (write) cprintf("read/write.\n");
+		else cprintf("read only.\n");
+	}
 	else
 	{
 		cprintf("0x%08x - 0x%08x: ", PTE_ADDR(*pg_table), PTE_ADDR(*pg_table) + PGSIZE - 1);
@@ -370,6 +387,105 @@ mon_continue(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc == 2 && strcmp(argv[1], "reset") == 0)
+		spin_reset_stats();
+	else if (argc == 1)
+		spin_print_stats();
+	else
+		cprintf("usage: lockstat [reset]\n");
+	return 0;
+}
+
+int
+mon_buddyinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	page_buddyinfo();
+	return 0;
+}
+
+int
+mon_zeropool(int argc, char **argv, struct Trapframe *tf)
+{
+	page_zeroinfo();
+	return 0;
+}
+
+int
+mon_ipcstat(int argc, char **argv, struct Trapframe *tf)
+{
+	ipc_print_stats();
+	return 0;
+}
+
+// tlbbench reads one word from every page of the same physical memory,
+// first through a temporary alias built from 4KB pages in the (unused)
+// user half of kern_pgdir, then through the 4MB pages at KERNBASE.  The
+// region is much larger than the TLB's reach with 4KB pages, but takes
+// only a handful of 4MB TLB entries.  Each run starts with every TLB
+// entry flushed, the global KERNBASE entries included, so that the two
+// runs differ only in page size.
+#define TLBBENCH_VA	0x10000000
+#define TLBBENCH_SIZE	(16 * PTSIZE)
+#define TLBBENCH_PASSES	16
+
+static uint64_t
+tlbbench_touch(uintptr_t base, size_t size)
+{
+	uint32_t cr4 = rcr4();
+	uint64_t start;
+	size_t off;
+	int pass;
+
+	// Turning CR4_PGE off and on again flushes global entries too.
+	lcr4(cr4 & ~CR4_PGE);
+	lcr4(cr4);
+	start = read_tsc();
+	for (pass = 0; pass < TLBBENCH_PASSES; pass++)
+		for (off = 0; off < size; off += PGSIZE)
+			(void) *(volatile uint32_t *) (base + off);
+	return (read_tsc() - start) / (TLBBENCH_PASSES * (size / PGSIZE));
+}
+
+int
+mon_tlbbench(int argc, char **argv, struct Trapframe *tf)
+{
+	size_t size = MIN(ROUNDDOWN(npages * PGSIZE, PTSIZE), TLBBENCH_SIZE);
+	pde_t *pgdir = thiscpu->cpu_pgdir;
+	uint64_t small, large;
+	size_t off;
+	pte_t *pte;
+	int r = 0;
+
+	load_pgdir(kern_pgdir);
+	for (off = 0; off < size; off += PGSIZE) {
+		if (!(pte = pgdir_walk(kern_pgdir, (void *) (TLBBENCH_VA + off), 1))) {
+			cprintf("tlbbench: out of memory\n");
+			r = -1;
+			goto out;
+		}
+		*pte = off | PTE_P;
+	}
+
+	small = tlbbench_touch(TLBBENCH_VA, size);
+	large = tlbbench_touch(KERNBASE, size);
+	cprintf("%dMB, %d passes: 4KB pages %llu cycles/access, "
+		"4MB pages %llu cycles/access\n",
+		size >> 20, TLBBENCH_PASSES, small, large);
+
+out:
+	for (off = 0; off < size; off += PTSIZE) {
+		pde_t *pde = &kern_pgdir[PDX(TLBBENCH_VA + off)];
+		if (*pde & PTE_P)
+			page_decref(pa2page(PTE_ADDR(*pde)));
+		*pde = 0;
+	}
+	load_pgdir(pgdir);
+	return r;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
@@ -21,5 +21,10 @@ int mon_dump(int argc, char **argv, struct Trapframe *tf);
 int mon_lookmem(int argc, char **argv, struct Trapframe *tf);
 int mon_singlestep(int argc, char **argv, struct Trapframe *tf);
 int mon_continue(int argc, char **argv, struct Trapframe *tf);
+int mon_lockstat(int argc, char **argv, struct Trapframe *tf);
+int mon_buddyinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_zeropool(int argc, char **argv, struct Trapframe *tf);
+int mon_ipcstat(int argc, char **argv, struct Trapframe *tf);
+int mon_tlbbench(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
@@ -7,9 +7,11 @@
 #include <inc/assert.h>
 
 #include <kern/pmap.h>
+#include <kern/kmem.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -18,7 +20,62 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+
+// Free physical memory is managed by a buddy allocator: buddy_free[k]
+// lists the free blocks of 2^k pages, linked through pp_link/pp_prev
+// of each block's first page.  Freeing a block whose buddy (the other
+// half of the next larger aligned block) is also free merges the two.
+static struct PageInfo *buddy_free[PAGE_MAX_ORDER + 1];
+static struct spinlock page_lock;	// Protects buddy_free
+
+// Per-CPU caches ("magazines") of free pages in front of the buddy
+// allocator, so that most page_alloc and page_free calls touch only
+// CPU-local state.  A cache is refilled from, and drained to, the
+// buddy allocator PAGE_CACHE_BATCH pages at a time, under a single
+// page_lock acquisition.  Each cache has a lock, taken before page_lock,
+// which only its own CPU takes unless memory runs out: then page_alloc
+// drains every CPU's cache back to the buddy allocator.
+#define PAGE_CACHE_SIZE		64	// Most pages a CPU keeps cached
+#define PAGE_CACHE_BATCH	32	// Pages moved per refill or drain
+
+struct PageCache {
+	struct spinlock pc_lock;
+	struct PageInfo *pc_head;	// Cached pages, linked by pp_link
+	int pc_count;
+	uint32_t pc_zero_hits;		// ALLOC_ZERO served from zero_pool
+	uint32_t pc_zero_misses;	// ALLOC_ZERO that had to memset
+};
+
+static struct PageCache page_caches[NCPU];
+
+// The caches are off while mem_init's checks run, since those count
+// on every free page being in the buddy allocator.
+static bool page_caches_enabled;
+
+// Free pages that idle CPUs have already filled with zeroes, so that
+// page_alloc(ALLOC_ZERO) is usually just a list pop.  Pages in the pool
+// are still free: page_alloc falls back on them when all else is gone.
+#define ZERO_POOL_SIZE		256	// Most pages kept zeroed
+
+static struct PageInfo *zero_pool;	// Linked by pp_link
+static int zero_pool_count;
+static struct spinlock zero_pool_lock;	// Protects zero_pool
+
+// The TLB shootdown in flight; see tlb_batch_flush.
+static struct spinlock shootdown_lock;	// Held by the CPU shooting down
+static struct {
+	pde_t *sd_pgdir;
+	int sd_n;			// -1 to flush everything
+	void *sd_va[TLB_BATCH_SIZE];
+} shootdown;
+static volatile uint32_t shootdown_pending;	// CPUs yet to invalidate
+
+// fork shares user page tables between parent and child: see
+// pgdir_fork.  A shared page table's page directory entries carry
+// PTE_COW instead of PTE_W, and its pp_ref counts the page directories
+// that refer to it.  The pages it maps hold one reference for the page
+// table, however many address spaces share it.
+static struct spinlock pt_share_lock;	// Protects shared pp_refs
 
 
 // --------------------------------------------------------------
@@ -83,7 +140,7 @@ static void check_page_installed_pgdir(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the free lists have been set up.
 static void *
 boot_alloc(uint32_t n)
 {
@@ -172,6 +229,8 @@ mem_init(void)
 	
 	check_page_free_list(1);
 	check_page_alloc();
+	kmem_init();
+	check_kmem();
 	check_page();
 
 	//////////////////////////////////////////////////////////////////////
@@ -233,7 +292,7 @@ mem_init(void)
 	//
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
-	lcr3(PADDR(kern_pgdir));
+	load_pgdir(kern_pgdir);
 
 	check_page_free_list(0);
 
@@ -246,6 +305,9 @@ mem_init(void)
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	// The checks are done with the buddy allocator; start caching pages.
+	page_caches_enabled = 1;
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -289,7 +351,7 @@ mem_init_mp(void)
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the buddy allocator's free lists.
 //
 void
 page_init(void)
@@ -297,6 +359,12 @@ page_init(void)
 	// LAB 4:
 	// Change your code to mark the physical page at MPENTRY_PADDR
 	// as in use
+	spin_initlock(&page_lock);
+	for (int c = 0; c < NCPU; c++)
+		spin_initlock(&page_caches[c].pc_lock);
+	spin_initlock(&zero_pool_lock);
+	spin_initlock(&shootdown_lock);
+	spin_initlock(&pt_share_lock);
 
 	// The example code here marks all physical pages as free.
 	// However this is not truly the case.  What memory is free?
@@ -315,25 +383,275 @@ page_init(void)
 	// Change the code to reflect this.
 	// NB: DO NOT actually touch the physical memory corresponding to
 	// free pages!
-	size_t i;
-	extern char end[];
+	size_t i, j;
+	int order;
+	struct PageInfo *tail[PAGE_MAX_ORDER + 1];
 	char* endOfPages = boot_alloc(0);
 	//cprintf("%x %x %x %d\n",endOfPages,boot_alloc(0),pages,npages);
 	//endOfPages = boot_alloc(0);
 	size_t beginIO = IOPHYSMEM / PGSIZE, endIO = EXTPHYSMEM / PGSIZE;
-	page_free_list = NULL;
 	for (i = 0; i < npages; i++) {
 		pages[i].pp_ref = 0;
-		pages[i].pp_link = NULL;
-		if (!(i >= beginIO && i < endIO))
-			if ((i > 0 && i < npages_basemem) ||
-				((char*) page2kva(&pages[i]) >= endOfPages))
-				{
-					if ((uint32_t) page2pa(&pages[i]) == MPENTRY_PADDR) continue;
-					pages[i].pp_link = page_free_list;
-					page_free_list = &pages[i];
-				}
+		pages[i].pp_link = pages[i].pp_prev = NULL;
+		pages[i].pp_order = pages[i].pp_flags = 0;
+	}
+	for (order = 0; order <= PAGE_MAX_ORDER; order++)
+		buddy_free[order] = tail[order] = NULL;
+
+#define PAGE_FREE_AT_BOOT(i)						\
+	(!((i) >= beginIO && (i) < endIO)				\
+	 && (((i) > 0 && (i) < npages_basemem)				\
+	     || (char*) page2kva(&pages[i]) >= endOfPages)		\
+	 && page2pa(&pages[i]) != MPENTRY_PADDR)
+
+	// Carve each run of free pages [i, j) into the largest aligned
+	// blocks that fit.  Append them, so that each free list starts
+	// out sorted by address: the page tables mem_init allocates
+	// while entry_pgdir maps only the first 4MB then come from low
+	// memory.
+	for (i = 0; i < npages; i = j) {
+		if (!PAGE_FREE_AT_BOOT(i)) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i; j < npages && PAGE_FREE_AT_BOOT(j); j++)
+			/* do nothing */;
+		while (i < j) {
+			for (order = PAGE_MAX_ORDER;
+			     (i & ((1 << order) - 1)) || i + (1 << order) > j;
+			     order--)
+				/* do nothing */;
+			pages[i].pp_order = order;
+			pages[i].pp_flags = PP_BUDDY;
+			pages[i].pp_prev = tail[order];
+			if (tail[order])
+				tail[order]->pp_link = &pages[i];
+			else
+				buddy_free[order] = &pages[i];
+			tail[order] = &pages[i];
+			i += 1 << order;
+		}
+	}
+#undef PAGE_FREE_AT_BOOT
+}
+
+//
+// Buddy allocator internals.  The caller must hold page_lock.
+//
+
+// Put the free block starting at pp, of 2^order pages, on its list.
+static void
+buddy_push(struct PageInfo *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_flags |= PP_BUDDY;
+	pp->pp_prev = NULL;
+	pp->pp_link = buddy_free[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp;
+	buddy_free[order] = pp;
+}
+
+// Take the free block starting at pp off its list.
+static void
+buddy_unlink(struct PageInfo *pp)
+{
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		buddy_free[pp->pp_order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	pp->pp_link = pp->pp_prev = NULL;
+	pp->pp_flags &= ~PP_BUDDY;
+}
+
+// Allocate a block of 2^order pages by splitting the smallest free
+// block that is large enough.  Returns NULL if there is none.
+static struct PageInfo *
+buddy_alloc(int order)
+{
+	struct PageInfo *pp;
+	int k;
+
+	for (k = order; k <= PAGE_MAX_ORDER && !buddy_free[k]; k++)
+		/* do nothing */;
+	if (k > PAGE_MAX_ORDER)
+		return NULL;
+	pp = buddy_free[k];
+	buddy_unlink(pp);
+	// Keep the lower half and free the upper half until the
+	// block is the right size.
+	while (k > order) {
+		k--;
+		buddy_push(pp + (1 << k), k);
+	}
+	return pp;
+}
+
+// Free the block of 2^order pages starting at pp, merging it with its
+// buddy for as long as the buddy is free too.
+static void
+buddy_release(struct PageInfo *pp, int order)
+{
+	size_t i = pp - pages, b;
+
+	for (; order < PAGE_MAX_ORDER; order++) {
+		b = i ^ (1 << order);
+		if (b >= npages || !(pages[b].pp_flags & PP_BUDDY)
+		    || pages[b].pp_order != order)
+			break;
+		buddy_unlink(&pages[b]);
+		i &= ~(1 << order);
 	}
+	buddy_push(&pages[i], order);
+}
+
+// Count the pages on the buddy free lists.
+static size_t
+buddy_nfree(void)
+{
+	struct PageInfo *pp;
+	size_t nfree = 0;
+	int order;
+
+	for (order = 0; order <= PAGE_MAX_ORDER; order++)
+		for (pp = buddy_free[order]; pp; pp = pp->pp_link)
+			nfree += 1 << order;
+	return nfree;
+}
+
+//
+// Give the pages in every CPU's cache back to the buddy allocator, for
+// when it has run out: cached pages must not make an allocation fail.
+// Returns the number of pages given back.
+//
+static int
+page_caches_drain(void)
+{
+	struct PageCache *pc;
+	struct PageInfo *pp;
+	int n = 0;
+
+	for (pc = page_caches; pc < page_caches + NCPU; pc++) {
+		// Peeking without the lock is fine: a page freed into the
+		// cache meanwhile is not needed to make progress.
+		if (!pc->pc_head)
+			continue;
+		spin_lock(&pc->pc_lock);
+		spin_lock(&page_lock);
+		while ((pp = pc->pc_head)) {
+			pc->pc_head = pp->pp_link;
+			pp->pp_link = NULL;
+			buddy_release(pp, 0);
+			n++;
+		}
+		pc->pc_count = 0;
+		spin_unlock(&page_lock);
+		spin_unlock(&pc->pc_lock);
+	}
+	return n;
+}
+
+//
+// Allocates a physically contiguous block of 2^order pages, aligned to
+// its size.  If (alloc_flags & ALLOC_ZERO), fills the whole block with
+// '\0' bytes.  As with page_alloc, the reference count is not
+// incremented; only the first PageInfo of the block counts as the
+// block's handle, to be passed to page_free_order with the same order.
+//
+// Returns NULL if no large enough free block exists.
+//
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+
+	if (order < 0 || order > PAGE_MAX_ORDER)
+		return NULL;
+	spin_lock(&page_lock);
+	pp = buddy_alloc(order);
+	spin_unlock(&page_lock);
+	if (!pp && page_caches_drain()) {
+		spin_lock(&page_lock);
+		pp = buddy_alloc(order);
+		spin_unlock(&page_lock);
+	}
+	if (pp && (alloc_flags & ALLOC_ZERO))
+		memset(page2kva(pp), 0, PGSIZE << order);
+	return pp;
+}
+
+//
+// Return a block of 2^order pages allocated by page_alloc_order.
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+	if (pp->pp_ref || pp->pp_link != NULL)
+		panic("pp->pp_ref is nonzero or pp->pp_link is not NULL.");
+	if ((pp - pages) & ((1 << order) - 1))
+		panic("page_free_order: block not aligned to its order");
+	spin_lock(&page_lock);
+	buddy_release(pp, order);
+	spin_unlock(&page_lock);
+}
+
+//
+// Print how free memory is split up among block sizes.  For each
+// order, 'unusable' is the share of free memory that lies in blocks
+// too small to satisfy an allocation of that order: the higher it is,
+// the more fragmented memory is for allocations of that size.
+//
+void
+page_buddyinfo(void)
+{
+	size_t nblocks[PAGE_MAX_ORDER + 1], nfree = 0, nlarger = 0, ncached = 0;
+	struct PageInfo *pp;
+	int order, i;
+
+	spin_lock(&page_lock);
+	for (order = 0; order <= PAGE_MAX_ORDER; order++) {
+		nblocks[order] = 0;
+		for (pp = buddy_free[order]; pp; pp = pp->pp_link)
+			nblocks[order]++;
+		nfree += nblocks[order] << order;
+	}
+	spin_unlock(&page_lock);
+	for (i = 0; i < NCPU; i++)
+		ncached += page_caches[i].pc_count;
+
+	cprintf("order  block size  free blocks  unusable\n");
+	for (order = PAGE_MAX_ORDER; order >= 0; order--) {
+		nlarger += nblocks[order] << order;
+		cprintf("%5d  %8dKB  %11d  %7d%%\n", order, 4 << order,
+			nblocks[order],
+			nfree ? (nfree - nlarger) * 100 / nfree : 0);
+	}
+	cprintf("%d free pages, %d more in per-CPU caches, %d in the zero pool\n",
+		nfree, ncached, zero_pool_count);
+}
+
+// Take a page from the pool of zeroed pages, or return NULL if it is
+// empty.
+static struct PageInfo *
+zero_pool_pop(void)
+{
+	struct PageInfo *pp;
+
+	// Peeking without the lock is fine: the worst case is a missed
+	// or wasted lock acquisition.
+	if (!zero_pool)
+		return NULL;
+	spin_lock(&zero_pool_lock);
+	if ((pp = zero_pool)) {
+		zero_pool = pp->pp_link;
+		zero_pool_count--;
+	}
+	spin_unlock(&zero_pool_lock);
+	if (pp)
+		pp->pp_link = NULL;
+	return pp;
 }
 
 //
@@ -352,12 +670,47 @@ struct PageInfo *
 page_alloc(int alloc_flags)
 {
 	// Fill this function in
-	if (!page_free_list) return NULL;
-	if (alloc_flags & ALLOC_ZERO)
-		memset(page2kva(page_free_list), 0, PGSIZE);
-	struct PageInfo *ret = page_free_list;
-	page_free_list = ret->pp_link;
+	struct PageInfo *ret;
+	struct PageCache *pc = &page_caches[cpunum()];
+	int n;
+
+	if (page_caches_enabled && (alloc_flags & ALLOC_ZERO)) {
+		if ((ret = zero_pool_pop())) {
+			pc->pc_zero_hits++;
+			return ret;
+		}
+		pc->pc_zero_misses++;
+	}
+
+	if (page_caches_enabled) {
+		spin_lock(&pc->pc_lock);
+		if (!pc->pc_head) {
+			// Refill with a batch from the buddy allocator.
+			spin_lock(&page_lock);
+			for (n = 0; n < PAGE_CACHE_BATCH
+				     && (ret = buddy_alloc(0)); n++) {
+				ret->pp_link = pc->pc_head;
+				pc->pc_head = ret;
+			}
+			spin_unlock(&page_lock);
+			pc->pc_count = n;
+		}
+		if ((ret = pc->pc_head)) {
+			pc->pc_head = ret->pp_link;
+			pc->pc_count--;
+		}
+		spin_unlock(&pc->pc_lock);
+	} else
+		return page_alloc_order(0, alloc_flags);
+	if (!ret && !(ret = zero_pool_pop())) {
+		// Other CPUs may still cache free pages.
+		if (!page_caches_drain())
+			return NULL;
+		return page_alloc_order(0, alloc_flags);
+	}
 	ret->pp_link = NULL;
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(ret), 0, PGSIZE);
 	return ret;
 }
 
@@ -373,8 +726,72 @@ page_free(struct PageInfo *pp)
 	// pp->pp_link is not NULL.
 	if (pp->pp_ref || pp->pp_link != NULL)
 		panic("pp->pp_ref is nonzero or pp->pp_link is not NULL.");
-	pp->pp_link = page_free_list;
-	page_free_list = pp;
+	if (page_caches_enabled) {
+		struct PageCache *pc = &page_caches[cpunum()];
+
+		spin_lock(&pc->pc_lock);
+		pp->pp_link = pc->pc_head;
+		pc->pc_head = pp;
+		if (++pc->pc_count >= PAGE_CACHE_SIZE) {
+			// Full: give a batch back to the buddy allocator.
+			spin_lock(&page_lock);
+			for (; pc->pc_count > PAGE_CACHE_SIZE - PAGE_CACHE_BATCH;
+			     pc->pc_count--) {
+				pp = pc->pc_head;
+				pc->pc_head = pp->pp_link;
+				pp->pp_link = NULL;
+				buddy_release(pp, 0);
+			}
+			spin_unlock(&page_lock);
+		}
+		spin_unlock(&pc->pc_lock);
+		return;
+	}
+	page_free_order(pp, 0);
+}
+
+//
+// Zero one free page and add it to the pool of zeroed pages, unless the
+// pool is full.  Idle CPUs call this while they wait for work.
+// Returns 1 if it zeroed a page, 0 if there was nothing to do.
+//
+int
+page_zero_refill(void)
+{
+	struct PageInfo *pp;
+
+	if (!page_caches_enabled || zero_pool_count >= ZERO_POOL_SIZE)
+		return 0;
+	if (!(pp = page_alloc(0)))
+		return 0;
+	memset(page2kva(pp), 0, PGSIZE);
+	spin_lock(&zero_pool_lock);
+	pp->pp_link = zero_pool;
+	zero_pool = pp;
+	zero_pool_count++;
+	spin_unlock(&zero_pool_lock);
+	return 1;
+}
+
+//
+// Print the size of the zeroed page pool and how often
+// page_alloc(ALLOC_ZERO) found a page there, per CPU.
+//
+void
+page_zeroinfo(void)
+{
+	uint32_t hits = 0, misses = 0;
+	int i;
+
+	cprintf("zero pool: %d of %d pages\n", zero_pool_count, ZERO_POOL_SIZE);
+	for (i = 0; i < ncpu; i++) {
+		cprintf("  CPU %d: %u hits, %u misses\n", i,
+			page_caches[i].pc_zero_hits,
+			page_caches[i].pc_zero_misses);
+		hits += page_caches[i].pc_zero_hits;
+		misses += page_caches[i].pc_zero_misses;
+	}
+	cprintf("  total: %u hits, %u misses\n", hits, misses);
 }
 
 //
@@ -384,7 +801,11 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	uint8_t zero;
+
+	asm volatile("lock; decw %0; sete %1"
+		     : "+m" (pp->pp_ref), "=q" (zero) : : "cc");
+	if (zero)
 		page_free(pp);
 }
 
@@ -400,6 +821,14 @@ page_decref(struct PageInfo* pp)
 //	the page is cleared,
 //	and pgdir_walk returns a pointer into the new page table page.
 //
+// If the page directory entry itself maps a 4MB page (PTE_PS), there is
+// no page table, and pgdir_walk returns a pointer to the page directory
+// entry.  boot_map_region only creates such entries above UTOP.
+//
+// If create is true, the caller means to change the page table, so a
+// page table shared copy-on-write is made private first (see
+// pgdir_unshare); pgdir_walk returns NULL if that runs out of memory.
+//
 // Hint 1: you can turn a PageInfo * into the physical address of the
 // page it refers to with page2pa() from kern/pmap.h.
 //
@@ -414,7 +843,11 @@ pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
 	uint32_t pdx = PDX(va), ptx = PTX(va);
+	if (create && pgdir_unshare(pgdir, va) < 0)
+		return NULL;
 	pte_t* toPageTable = (pte_t*) pgdir[pdx];
+	if ((uint32_t) toPageTable & PTE_PS)
+		return &pgdir[pdx];
 	if (!((uint32_t) toPageTable & PTE_P))
 	{
 		if (create == false) return NULL;
@@ -422,7 +855,7 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 		{
 			struct PageInfo* convert = page_alloc(ALLOC_ZERO);
 			if (convert == NULL) return NULL;
-			convert->pp_ref++;
+			page_incref(convert);
 			pgdir[pdx] = page2pa(convert) | PTE_P | PTE_W | PTE_U;
 			toPageTable = (pte_t*) pgdir[pdx];
 		}
@@ -442,16 +875,32 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 // above UTOP. As such, it should *not* change the pp_ref field on the
 // mapped pages.
 //
+// These mappings are the same in every address space, so they are
+// marked global (PTE_G): the TLB keeps them across the lcr3 in env_run
+// and only invlpg drops them.
+//
+// Wherever va and pa are both 4MB-aligned and at least 4MB remain, the
+// region is mapped with a single large (PTE_PS) page directory entry
+// instead of a page table: that saves the page table page and lets one
+// TLB entry cover the whole 4MB.
+//
 // Hint: the TA solution uses pgdir_walk
 static void
 boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
 {
-	for(size_t i = 0;i < size / PGSIZE;i++)
-	{
-		uint32_t ava = (uint32_t) va + i * PGSIZE;
-		pte_t *pgtable = pgdir_walk(pgdir, (void*) ava, true);
-		uint32_t offset = PGOFF(ava);
-		*pgtable = (pa + i * PGSIZE) | (perm|PTE_P);
+	size_t i = 0;
+
+	while (i < size) {
+		uint32_t ava = (uint32_t) va + i;
+		if (ava % PTSIZE == 0 && (pa + i) % PTSIZE == 0
+		    && size - i >= PTSIZE && !(pgdir[PDX(ava)] & PTE_P)) {
+			pgdir[PDX(ava)] = (pa + i) | perm | PTE_P | PTE_G | PTE_PS;
+			i += PTSIZE;
+		} else {
+			pte_t *pgtable = pgdir_walk(pgdir, (void*) ava, true);
+			*pgtable = (pa + i) | (perm|PTE_P|PTE_G);
+			i += PGSIZE;
+		}
 	}
 }
 
@@ -483,17 +932,30 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 int
 page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
-	//cprintf("%x\n",page_free_list);
+	struct tlb_batch tb;
+	int r;
+
+	tlb_batch_init(&tb, pgdir);
+	r = page_insert_batch(pgdir, pp, va, perm, &tb);
+	tlb_batch_flush(&tb);
+	return r;
+}
+
+//
+// Like page_insert, but add the TLB invalidation for any page that was
+// mapped at 'va' to 'tb' rather than doing it right away.
+//
+int
+page_insert_batch(pde_t *pgdir, struct PageInfo *pp, void *va, int perm,
+		  struct tlb_batch *tb)
+{
 	pte_t *pgtable = pgdir_walk(pgdir, va, true);
-	uint32_t offset = PGOFF(va);
-	//cprintf("%x %x %x\n",va,pgdir,pgtable);
 	if (pgtable)
 	{
-		pp->pp_ref++;
-		//cprintf("%x\n",*pgtable);
+		page_incref(pp);
+		// Cannot fail: pgdir_walk made the page table private
 		if (*pgtable)
-			page_remove(pgdir, va);
-		//cprintf("%x %x\n",pgtable,*pgtable);
+			page_remove_batch(pgdir, va, tb);
 		*pgtable = page2pa(pp) | (perm|PTE_P);
 		return 0;
 	}
@@ -537,29 +999,194 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 // Hint: The TA solution is implemented using page_lookup,
 // 	tlb_invalidate, and page_decref.
 //
-void
+// Returns 0, or -E_NO_MEM if the page table was shared copy-on-write
+// and there was no memory to give pgdir its own copy.
+//
+int
 page_remove(pde_t *pgdir, void *va)
+{
+	struct tlb_batch tb;
+	int r;
+
+	tlb_batch_init(&tb, pgdir);
+	r = page_remove_batch(pgdir, va, &tb);
+	tlb_batch_flush(&tb);
+	return r;
+}
+
+//
+// Like page_remove, but add the TLB invalidation to 'tb' rather than
+// doing it right away.  The page is released by tlb_batch_flush.
+//
+int
+page_remove_batch(pde_t *pgdir, void *va, struct tlb_batch *tb)
 {
 	pte_t *pte_store;
 	struct PageInfo *thatPage = page_lookup(pgdir, va, &pte_store);
 	if (thatPage && (*pte_store & PTE_P))
 	{
-		page_decref(thatPage);
+		if (pgdir_unshare(pgdir, va) < 0)
+			return -E_NO_MEM;
+		// pgdir_unshare may have moved the PTE to a new page table
+		pte_store = pgdir_walk(pgdir, va, 0);
 		*pte_store = 0;
-		tlb_invalidate(pgdir, va);
+		tlb_batch_add(tb, va, thatPage);
+	}
+	return 0;
+}
+
+// --------------------------------------------------------------
+// TLB shootdown.
+//
+// Each CPU records the page directory it has loaded in cpu_pgdir.
+// After changing a page directory, a CPU invalidates its own TLB if
+// it has that page directory loaded, and interrupts the other CPUs
+// that do, then waits until they have all invalidated theirs.  Only
+// one shootdown is in flight at a time.  Interrupts are off in the
+// kernel, so CPUs also look for shootdown requests whenever they spin.
+// --------------------------------------------------------------
+
+//
+// Switch this CPU to page directory 'pgdir'.  All loads of %cr3 must
+// go through here so that shootdowns find this CPU.
+//
+void
+load_pgdir(pde_t *pgdir)
+{
+	// Publish cpu_pgdir before the switch: a CPU that changes pgdir
+	// after our lcr3 then finds us, and one that changed it before
+	// has its change seen by our page walks.
+	thiscpu->cpu_pgdir = pgdir;
+	lcr3(PADDR(pgdir));
+}
+
+void
+tlb_batch_init(struct tlb_batch *tb, pde_t *pgdir)
+{
+	tb->tb_pgdir = pgdir;
+	tb->tb_n = 0;
+}
+
+//
+// Record that the mapping of 'va' in tb's page directory has changed.
+// If 'pp' is not NULL, drop a reference to it once the TLBs are clean.
+//
+void
+tlb_batch_add(struct tlb_batch *tb, void *va, struct PageInfo *pp)
+{
+	if (tb->tb_n == TLB_BATCH_SIZE)
+		tlb_batch_flush(tb);
+	tb->tb_va[tb->tb_n] = va;
+	tb->tb_pp[tb->tb_n] = pp;
+	tb->tb_n++;
+}
+
+// Invalidate the TLB entries for the 'n' addresses in 'va' on every CPU
+// that has 'pgdir' loaded, or all of their non-global entries if 'n' is
+// negative.
+static void
+tlb_shootdown(pde_t *pgdir, void **va, int n)
+{
+	uint32_t targets = 0;
+	int i, me = cpunum();
+
+	// Before any CPU loads our pgdir (mem_init), there is nothing to
+	// go by; invalidate to be safe.
+	if (!thiscpu->cpu_pgdir || thiscpu->cpu_pgdir == pgdir) {
+		if (n < 0)
+			lcr3(rcr3());
+		for (i = 0; i < n; i++)
+			invlpg(va[i]);
 	}
+
+	// Order our page table writes before reading the other CPUs'
+	// cpu_pgdir; see load_pgdir.
+	asm volatile("mfence" ::: "memory");
+	for (i = 0; i < ncpu; i++)
+		if (i != me && cpus[i].cpu_pgdir == pgdir)
+			targets |= 1 << i;
+	if (!targets)
+		return;
+
+	spin_lock(&shootdown_lock);
+	shootdown.sd_pgdir = pgdir;
+	shootdown.sd_n = n;
+	if (n > 0)
+		memcpy(shootdown.sd_va, va, n * sizeof(void *));
+	shootdown_pending = targets;
+	for (i = 0; i < ncpu; i++)
+		if (targets & (1 << i))
+			lapic_ipi_cpu(cpus[i].cpu_id, T_TLBFLUSH);
+	while (shootdown_pending)
+		asm volatile("pause");
+	spin_unlock(&shootdown_lock);
+}
+
+//
+// Invalidate every TLB entry recorded in 'tb' on every CPU that has
+// tb's page directory loaded, then release the unmapped pages.
+//
+void
+tlb_batch_flush(struct tlb_batch *tb)
+{
+	int i;
+
+	if (tb->tb_n == 0)
+		return;
+	tlb_shootdown(tb->tb_pgdir, tb->tb_va, tb->tb_n);
+	for (i = 0; i < tb->tb_n; i++)
+		if (tb->tb_pp[i])
+			page_decref(tb->tb_pp[i]);
+	tb->tb_n = 0;
+}
+
+//
+// Invalidate all of the user TLB entries for 'pgdir' on every CPU that
+// has it loaded.  Cheaper than a batch when a whole address space
+// changes at once.
+//
+void
+tlb_flush_pgdir(pde_t *pgdir)
+{
+	tlb_shootdown(pgdir, NULL, -1);
 }
 
 //
-// Invalidate a TLB entry, but only if the page tables being
-// edited are the ones currently in use by the processor.
+// Carry out the shootdown request addressed to this CPU, if any.
+// Called from the T_TLBFLUSH interrupt and from every kernel loop
+// that waits on another CPU.
+//
+void
+tlb_shootdown_poll(void)
+{
+	uint32_t me = 1 << cpunum();
+	int i;
+
+	if (!(shootdown_pending & me))
+		return;
+	// If we have switched page directories since the request was
+	// sent, the switch already flushed the stale entries.
+	if (thiscpu->cpu_pgdir == shootdown.sd_pgdir) {
+		if (shootdown.sd_n < 0)
+			lcr3(rcr3());
+		for (i = 0; i < shootdown.sd_n; i++)
+			invlpg(shootdown.sd_va[i]);
+	}
+	asm volatile("lock; andl %1, %0"
+		     : "+m" (shootdown_pending) : "r" (~me) : "cc", "memory");
+}
+
+//
+// Invalidate a TLB entry on every CPU that has 'pgdir' loaded.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
-	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
-		invlpg(va);
+	struct tlb_batch tb;
+
+	tlb_batch_init(&tb, pgdir);
+	tlb_batch_add(&tb, va, NULL);
+	tlb_batch_flush(&tb);
 }
 
 //
@@ -606,6 +1233,215 @@ mmio_map_region(physaddr_t pa, size_t size)
 	return (void *) ret;
 }
 
+//
+// Resolve a write fault at 'va' in environment 'e' if 'va' is mapped
+// copy-on-write: give 'e' a private, writable copy of the page.  If 'e'
+// holds the only reference to the page, there is nobody to copy it
+// from, and the page is simply made writable.  If the page table is
+// shared copy-on-write, 'e' first gets its own copy of it, which may
+// be all the fault needed.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if 'va' is not mapped copy-on-write.
+//	-E_NO_MEM if there's no memory to copy the page to.
+//
+int
+page_cow_fault(struct Env *e, uintptr_t va)
+{
+	struct PageInfo *pp, *np;
+	pte_t *pte;
+	int perm, r = 0;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if (va >= UTOP)
+		return -E_INVAL;
+	spin_lock(env_vm_lock(e));
+	pte = pgdir_walk(e->env_pgdir, (void *) va, 0);
+	if (pte && (e->env_pgdir[PDX(va)] & PTE_COW)
+	    && (*pte & (PTE_P|PTE_U)) == (PTE_P|PTE_U)) {
+		if ((r = pgdir_unshare(e->env_pgdir, (void *) va)) < 0)
+			goto out;
+		pte = pgdir_walk(e->env_pgdir, (void *) va, 0);
+		if (*pte & PTE_W)
+			goto out;
+	}
+	if (!pte || (*pte & (PTE_P|PTE_U|PTE_W|PTE_COW)) != (PTE_P|PTE_U|PTE_COW)) {
+		r = -E_INVAL;
+		goto out;
+	}
+	pp = pa2page(PTE_ADDR(*pte));
+	perm = ((*pte & PTE_SYSCALL) & ~PTE_COW) | PTE_W;
+	// Only mappings in e refer to pp if pp_ref is 1, and nobody can
+	// map e's pages elsewhere while we hold e's address space lock.
+	if (pp->pp_ref == 1) {
+		*pte = page2pa(pp) | perm;
+		tlb_invalidate(e->env_pgdir, (void *) va);
+		goto out;
+	}
+	if (!(np = page_alloc(0))) {
+		r = -E_NO_MEM;
+		goto out;
+	}
+	memcpy(page2kva(np), page2kva(pp), PGSIZE);
+	// Cannot fail: the page table exists
+	page_insert(e->env_pgdir, np, (void *) va, perm);
+out:
+	spin_unlock(env_vm_lock(e));
+	return r;
+}
+
+//
+// Give 'pgdir' a private copy of the page table for 'va' if it shares
+// that page table copy-on-write with other page directories.  The
+// writable pages the page table maps, other than PTE_SHARE pages,
+// become copy-on-write in the copy and in the shared original, since
+// both still refer to them.  The last page directory left sharing a
+// page table just takes it over.
+//
+// Returns 0 on success, -E_NO_MEM if there's no memory for the copy.
+//
+int
+pgdir_unshare(pde_t *pgdir, const void *va)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	struct PageInfo *pt, *np;
+	pte_t *opt, *npt, pte;
+	int i, r = 0;
+
+	if ((*pde & (PTE_P|PTE_PS|PTE_COW)) != (PTE_P|PTE_COW))
+		return 0;
+	pt = pa2page(PTE_ADDR(*pde));
+	spin_lock(&pt_share_lock);
+	if (pt->pp_ref == 1) {
+		*pde = PTE_ADDR(*pde) | PTE_P | PTE_W | PTE_U;
+		goto out;
+	}
+	if (!(np = page_alloc(0))) {
+		r = -E_NO_MEM;
+		goto out;
+	}
+	opt = (pte_t *) page2kva(pt);
+	npt = (pte_t *) page2kva(np);
+	for (i = 0; i < NPTENTRIES; i++) {
+		if (!((pte = opt[i]) & PTE_P)) {
+			npt[i] = 0;
+			continue;
+		}
+		if ((pte & (PTE_W|PTE_SHARE)) == PTE_W)
+			opt[i] = pte = (pte & ~PTE_W) | PTE_COW;
+		page_incref(pa2page(PTE_ADDR(pte)));
+		npt[i] = pte;
+	}
+	page_incref(np);
+	page_decref(pt);
+	*pde = page2pa(np) | PTE_P | PTE_W | PTE_U;
+out:
+	spin_unlock(&pt_share_lock);
+	// Drop translations made through the read-only directory entry;
+	// they would fault on the first write.
+	if (r == 0)
+		tlb_flush_pgdir(pgdir);
+	return r;
+}
+
+//
+// Drop page directory entry 'pde's reference to its page table if the
+// page table is shared with other page directories, and clear 'pde'.
+// Returns 1 if so, 0 if 'pde' holds the only reference, in which case
+// it is left alone and the caller must free the page table.
+//
+int
+pgdir_drop_shared(pde_t *pde)
+{
+	struct PageInfo *pt = pa2page(PTE_ADDR(*pde));
+	int shared = 0;
+
+	if (!(*pde & PTE_COW))
+		return 0;
+	spin_lock(&pt_share_lock);
+	if (pt->pp_ref > 1) {
+		page_decref(pt);
+		*pde = 0;
+		shared = 1;
+	}
+	spin_unlock(&pt_share_lock);
+	return shared;
+}
+
+//
+// Give page directory 'child' the user mappings of 'parent' below
+// 'end', as fork does: PTE_SHARE pages are shared as they are, writable
+// and copy-on-write pages become copy-on-write in both, and read-only
+// pages are shared read-only.
+//
+// Page tables that lie wholly below 'end' are not copied: parent and
+// child share them copy-on-write, and each gets its own copy of one on
+// the first change to it (see pgdir_unshare).  So the cost of fork
+// depends on the number of page tables, not the number of pages.  The
+// parent's TLBs are flushed once at the end.
+//
+// The caller must hold the address space locks of both.
+//
+// Returns 0 on success, -E_NO_MEM if out of memory for page tables, in
+// which case the child may hold some of the mappings.
+//
+int
+pgdir_fork(pde_t *child, pde_t *parent, uintptr_t end)
+{
+	struct PageInfo *pt;
+	pte_t *ppt, *cpt;
+	uint32_t pdeno, pteno, pte, perm;
+	bool cow = 0;
+	int r = 0;
+
+	for (pdeno = 0; (uintptr_t) PGADDR(pdeno, 0, 0) < end; pdeno++) {
+		if (!(parent[pdeno] & PTE_P))
+			continue;
+		if ((uintptr_t) PGADDR(pdeno + 1, 0, 0) <= end) {
+			spin_lock(&pt_share_lock);
+			if (parent[pdeno] & PTE_W) {
+				parent[pdeno] = (parent[pdeno] & ~PTE_W) | PTE_COW;
+				cow = 1;
+			}
+			page_incref(pa2page(PTE_ADDR(parent[pdeno])));
+			child[pdeno] = parent[pdeno];
+			spin_unlock(&pt_share_lock);
+			continue;
+		}
+		ppt = (pte_t *) KADDR(PTE_ADDR(parent[pdeno]));
+		cpt = NULL;
+		for (pteno = 0; pteno < NPTENTRIES
+			     && (uintptr_t) PGADDR(pdeno, pteno, 0) < end; pteno++) {
+			pte = ppt[pteno];
+			if ((pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+				continue;
+			if (!cpt) {
+				if (!(pt = page_alloc(ALLOC_ZERO))) {
+					r = -E_NO_MEM;
+					goto out;
+				}
+				page_incref(pt);
+				child[pdeno] = page2pa(pt) | PTE_P | PTE_W | PTE_U;
+				cpt = (pte_t *) page2kva(pt);
+			}
+			perm = pte & PTE_SYSCALL;
+			if (!(perm & PTE_SHARE) && (perm & (PTE_W|PTE_COW))) {
+				perm = (perm & ~PTE_W) | PTE_COW;
+				if (pte & PTE_W) {
+					ppt[pteno] = (pte & ~PTE_W) | PTE_COW;
+					cow = 1;
+				}
+			}
+			page_incref(pa2page(PTE_ADDR(pte)));
+			cpt[pteno] = PTE_ADDR(pte) | perm;
+		}
+	}
+out:
+	if (cow)
+		tlb_flush_pgdir(parent);
+	return r;
+}
+
 static uintptr_t user_mem_check_addr;
 
 //
@@ -680,60 +1516,59 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // --------------------------------------------------------------
 
 //
-// Check that the pages on the page_free_list are reasonable.
+// Check that the pages on the free lists are reasonable.
 //
 static void
 check_page_free_list(bool only_low_memory)
 {
-	struct PageInfo *pp;
+	struct PageInfo *blk, *pp;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
+	int order, i;
 	char *first_free_page;
 
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
-
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
-		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
-	}
-	
+	// page_init lists the blocks of each order in address order and
+	// the allocator splits the smallest blocks first, so the pages
+	// handed out while entry_pgdir maps only the first 4MB come from
+	// low memory.
+	if (!buddy_nfree())
+		panic("no free pages!");
+
 	// if there's a page that shouldn't be on the free list,
 	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
+	for (order = 0; order <= PAGE_MAX_ORDER; order++)
+		for (blk = buddy_free[order]; blk; blk = blk->pp_link)
+			for (i = 0, pp = blk; i < (1 << order); i++, pp++)
+				if (PDX(page2pa(pp)) < pdx_limit)
+					memset(page2kva(pp), 0x97, 128);
 
 	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
+	for (order = 0; order <= PAGE_MAX_ORDER; order++)
+	for (blk = buddy_free[order]; blk; blk = blk->pp_link) {
 		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-		// (new test for lab 4)
-		assert(page2pa(pp) != MPENTRY_PADDR);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
+		assert(blk >= pages);
+		assert(blk + (1 << order) <= pages + npages);
+		assert(((char *) blk - (char *) pages) % sizeof(*blk) == 0);
+		assert(((blk - pages) & ((1 << order) - 1)) == 0);
+		assert(blk->pp_flags & PP_BUDDY);
+		assert(blk->pp_order == order);
+		assert(!blk->pp_link || blk->pp_link->pp_prev == blk);
+
+		for (i = 0, pp = blk; i < (1 << order); i++, pp++) {
+			// check a few pages that shouldn't be on the free list
+			assert(page2pa(pp) != 0);
+			assert(page2pa(pp) != IOPHYSMEM);
+			assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+			assert(page2pa(pp) != EXTPHYSMEM);
+			assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
+			// (new test for lab 4)
+			assert(page2pa(pp) != MPENTRY_PADDR);
+
+			if (page2pa(pp) < EXTPHYSMEM)
+				++nfree_basemem;
+			else
+				++nfree_extmem;
+		}
 	}
 
 	assert(nfree_basemem > 0);
@@ -742,9 +1577,36 @@ check_page_free_list(bool only_low_memory)
 	cprintf("check_page_free_list() succeeded!\n");
 }
 
+// Temporarily steal all free pages, so that the checks can run the
+// allocator out of memory.  Returns them chained through pp_link.
+static struct PageInfo *
+check_steal_free_pages(void)
+{
+	struct PageInfo *fl = NULL, *pp;
+
+	while ((pp = page_alloc(0))) {
+		pp->pp_link = fl;
+		fl = pp;
+	}
+	return fl;
+}
+
+// Give back the pages taken by check_steal_free_pages.
+static void
+check_return_free_pages(struct PageInfo *fl)
+{
+	struct PageInfo *pp;
+
+	while ((pp = fl)) {
+		fl = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
+}
+
 //
 // Check the physical page allocator (page_alloc(), page_free(),
-// and page_init()).
+// page_alloc_order(), page_free_order() and page_init()).
 //
 static void
 check_page_alloc(void)
@@ -759,8 +1621,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = buddy_nfree();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -776,8 +1637,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -805,7 +1665,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -813,9 +1673,25 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(buddy_nfree() == nfree);
+
+	// multi-page blocks are aligned to their size, and freeing them
+	// coalesces the free lists back to their original state
+	assert((pp0 = page_alloc_order(3, ALLOC_ZERO)));
+	assert((pp1 = page_alloc_order(0, 0)));
+	assert((pp2 = page_alloc_order(PAGE_MAX_ORDER, 0)));
+	assert(((pp0 - pages) & 7) == 0);
+	assert(((pp2 - pages) & ((1 << PAGE_MAX_ORDER) - 1)) == 0);
+	assert(pp1 < pp0 || pp1 >= pp0 + 8);
+	c = page2kva(pp0);
+	for (i = 0; i < 8 * PGSIZE; i++)
+		assert(c[i] == 0);
+	assert(buddy_nfree() == nfree - 9 - (1 << PAGE_MAX_ORDER));
+	assert(!page_alloc_order(PAGE_MAX_ORDER + 1, 0));
+	page_free_order(pp2, PAGE_MAX_ORDER);
+	page_free_order(pp0, 3);
+	page_free_order(pp1, 0);
+	assert(buddy_nfree() == nfree);
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
@@ -849,9 +1725,11 @@ check_kern_pgdir(void)
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
 
-	// check phys mem
+	// check phys mem, which is mapped with 4MB pages
 	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
+	for (i = KERNBASE; i != 0; i += PTSIZE)
+		assert((pgdir[PDX(i)] & (PTE_PS|PTE_G)) == (PTE_PS|PTE_G));
 
 	// check kernel stack
 	// (updated in lab 4 to check per-CPU kernel stacks)
@@ -899,6 +1777,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return (*pgdir & ~(PTSIZE - 1)) | (va & (PTSIZE - 1) & ~0xFFF);
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -928,8 +1808,7 @@ check_page(void)
 	assert(pp1 && pp1 != pp0);
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);	
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1049,7 +1928,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
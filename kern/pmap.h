@@ -51,20 +51,59 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// The buddy allocator hands out blocks of 2^order contiguous pages,
+// aligned to their size, for order 0 through PAGE_MAX_ORDER (4MB).
+#define PAGE_MAX_ORDER	10
+
+// Values for PageInfo.pp_flags
+#define PP_BUDDY	0x01	// First page of a block on a buddy free list
+
 void	mem_init(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
+void	page_free_order(struct PageInfo *pp, int order);
+void	page_buddyinfo(void);
+int	page_zero_refill(void);
+void	page_zeroinfo(void);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
-void	page_remove(pde_t *pgdir, void *va);
+int	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
 
+void	load_pgdir(pde_t *pgdir);
 void	tlb_invalidate(pde_t *pgdir, void *va);
 
+// A batch of TLB invalidations for one page directory.  Removing
+// several mappings through one batch costs at most one shootdown IPI
+// per TLB_BATCH_SIZE pages.  Pages unmapped through a batch are only
+// released once no CPU's TLB can still reach them.
+#define TLB_BATCH_SIZE	32
+
+struct tlb_batch {
+	pde_t *tb_pgdir;
+	int tb_n;
+	void *tb_va[TLB_BATCH_SIZE];
+	struct PageInfo *tb_pp[TLB_BATCH_SIZE];	// Pages to decref, or NULL
+};
+
+void	tlb_batch_init(struct tlb_batch *tb, pde_t *pgdir);
+void	tlb_batch_add(struct tlb_batch *tb, void *va, struct PageInfo *pp);
+void	tlb_batch_flush(struct tlb_batch *tb);
+void	tlb_flush_pgdir(pde_t *pgdir);
+int	page_remove_batch(pde_t *pgdir, void *va, struct tlb_batch *tb);
+int	page_insert_batch(pde_t *pgdir, struct PageInfo *pp, void *va, int perm,
+			  struct tlb_batch *tb);
+void	tlb_shootdown_poll(void);
+
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
+int	page_cow_fault(struct Env *e, uintptr_t va);
+int	pgdir_fork(pde_t *child, pde_t *parent, uintptr_t end);
+int	pgdir_unshare(pde_t *pgdir, const void *va);
+int	pgdir_drop_shared(pde_t *pde);
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
 
@@ -90,4 +129,13 @@ page2kva(struct PageInfo *pp)
 
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
 
+// A page's pp_ref counts mappings in every address space, and those are
+// changed under different locks on different CPUs, so pp_ref must only
+// be changed atomically: with page_incref and page_decref.
+static inline void
+page_incref(struct PageInfo *pp)
+{
+	asm volatile("lock; incw %0" : "+m" (pp->pp_ref) : : "cc");
+}
+
 #endif /* !JOS_KERN_PMAP_H */
@@ -5,6 +5,8 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/console.h>
+
 
 static void
 putch(int ch, int *cnt)
@@ -17,8 +19,11 @@ int
 vcprintf(const char *fmt, va_list ap)
 {
 	int cnt = 0;
+	bool locked = cons_lock_output();
 
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	if (locked)
+		cons_unlock_output();
 	return cnt;
 }
 
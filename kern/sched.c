@@ -4,87 +4,238 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/sched.h>
 
-void sched_halt(void);
+// Per-CPU queue of ENV_RUNNABLE environments, linked through
+// env_rq_next/env_rq_prev.  Environments are appended at the tail and
+// taken from the head, which gives round-robin order on each CPU.
+struct RunQueue {
+	struct spinlock rq_lock;
+	struct Env *rq_head;
+	struct Env *rq_tail;
+	int rq_len;
+};
+
+// An environment that left its CPU less than this many cycles ago
+// probably still has a warm cache and TLB there, so the load balancer
+// avoids migrating it if it has a choice.
+#define SCHED_MIGRATE_CYCLES	1000000
+
+// How many environments at the head of a victim queue the load
+// balancer examines when looking for a cache-cold one to steal.
+#define SCHED_STEAL_SCAN	4
+
+// How many times an idle CPU looks for work to steal before it
+// halts until the next interrupt.
+#define SCHED_IDLE_POLLS	128
+
+static struct RunQueue runqueues[NCPU];
+
+void sched_halt(void) __attribute__((noreturn));
+
+void
+sched_init(void)
+{
+	int i;
+
+	for (i = 0; i < NCPU; i++) {
+		spin_initlock(&runqueues[i].rq_lock);
+		runqueues[i].rq_head = runqueues[i].rq_tail = NULL;
+		runqueues[i].rq_len = 0;
+	}
+}
+
+// Append e to the tail of rq.  rq->rq_lock must be held.
+static void
+rq_append(struct RunQueue *rq, struct Env *e)
+{
+	e->env_rq_next = NULL;
+	e->env_rq_prev = rq->rq_tail;
+	if (rq->rq_tail)
+		rq->rq_tail->env_rq_next = e;
+	else
+		rq->rq_head = e;
+	rq->rq_tail = e;
+	rq->rq_len++;
+	e->env_rq_cpu = rq - runqueues;
+}
+
+// Unlink e from rq.  rq->rq_lock must be held.
+static void
+rq_remove(struct RunQueue *rq, struct Env *e)
+{
+	if (e->env_rq_prev)
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	else
+		rq->rq_head = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	else
+		rq->rq_tail = e->env_rq_prev;
+	e->env_rq_next = e->env_rq_prev = NULL;
+	e->env_rq_cpu = -1;
+	rq->rq_len--;
+}
+
+// Remove and return the environment at the head of rq, or NULL if
+// rq is empty.  This is the common, local scheduling path.
+static struct Env *
+rq_pop(struct RunQueue *rq)
+{
+	struct Env *e;
+
+	// Peeking without the lock is fine: the worst case is a missed
+	// or wasted lock acquisition.
+	if (!rq->rq_head)
+		return NULL;
+	spin_lock(&rq->rq_lock);
+	if ((e = rq->rq_head))
+		rq_remove(rq, e);
+	spin_unlock(&rq->rq_lock);
+	return e;
+}
+
+// Choose the CPU whose run queue should hold e.  Prefer the CPU e last
+// ran on, whose caches may still hold e's working set, unless that CPU
+// is halted and would leave e waiting for its next timer tick.
+// Environments that have never run start out on this CPU; idle CPUs
+// will steal them from here.
+static int
+sched_pick_cpu(struct Env *e)
+{
+	int cpu = e->env_cpunum;
+
+	if (cpu >= 0 && cpu < ncpu && cpus[cpu].cpu_status != CPU_HALTED)
+		return cpu;
+	return cpunum();
+}
+
+// Make the runnable environment e eligible to be picked by the
+// scheduler.  Queueing an environment that is already queued is a
+// no-op.
+void
+sched_enqueue(struct Env *e)
+{
+	struct RunQueue *rq = &runqueues[sched_pick_cpu(e)];
+
+	assert(e->env_status == ENV_RUNNABLE);
+	if (e->env_rq_cpu >= 0)
+		return;
+	spin_lock(&rq->rq_lock);
+	rq_append(rq, e);
+	spin_unlock(&rq->rq_lock);
+}
+
+// Take e off whatever run queue it is on, if any.
+void
+sched_dequeue(struct Env *e)
+{
+	struct RunQueue *rq;
+	int cpu;
+
+	if ((cpu = e->env_rq_cpu) < 0)
+		return;
+	rq = &runqueues[cpu];
+	spin_lock(&rq->rq_lock);
+	if (e->env_rq_cpu == cpu)
+		rq_remove(rq, e);
+	spin_unlock(&rq->rq_lock);
+}
+
+// Work stealing: take a runnable environment from the most loaded
+// other CPU, so that a CPU with an empty queue does not sit idle while
+// work is queued elsewhere.  Among the first few environments on that
+// queue, prefer one that has not run recently, since migrating it
+// costs little cache state.  An environment that is still cache-hot is
+// only taken if its CPU has more than one environment queued.
+//
+// This looks at a fixed ncpu queues and a bounded prefix of one of
+// them, regardless of how many environments exist.
+static struct Env *
+sched_steal(void)
+{
+	struct RunQueue *rq, *busiest = NULL;
+	struct Env *e;
+	uint64_t now;
+	int i, n, me = cpunum();
+
+	for (i = 0; i < ncpu; i++) {
+		rq = &runqueues[i];
+		if (i != me && rq->rq_len > 0
+		    && (!busiest || rq->rq_len > busiest->rq_len))
+			busiest = rq;
+	}
+	if (!busiest)
+		return NULL;
+
+	now = read_tsc();
+	spin_lock(&busiest->rq_lock);
+	for (e = busiest->rq_head, n = 0; e && n < SCHED_STEAL_SCAN;
+	     e = e->env_rq_next, n++)
+		if (now - e->env_stop_tsc >= SCHED_MIGRATE_CYCLES)
+			break;
+	if (!e || n == SCHED_STEAL_SCAN)
+		// Everything scanned is cache-hot
+		e = busiest->rq_len > 1 ? busiest->rq_head : NULL;
+	if (e)
+		rq_remove(busiest, e);
+	spin_unlock(&busiest->rq_lock);
+	return e;
+}
 
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	struct Env *idle;
+	struct Env *e;
 
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
+	// Run the environment at the head of this CPU's run queue.  If
+	// curenv was preempted, env_run() appends it to the tail of the
+	// queue, so every runnable environment gets its turn.  If this
+	// CPU's queue is empty, steal from the busiest other CPU.
 	//
+	// Never choose an environment that's currently running on
+	// another CPU: such environments are ENV_RUNNING and are not on
+	// any run queue.  Another CPU may destroy or run e after we pick
+	// it; env_try_run then returns and we pick again, rather than
+	// recursing into sched_yield on the same stack.
+	while ((e = rq_pop(&runqueues[cpunum()])) || (e = sched_steal()))
+		env_try_run(e);
+
 	// If no envs are runnable, but the environment previously
 	// running on this CPU is still ENV_RUNNING, it's okay to
 	// choose that environment.
-	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-
-	// LAB 4: Your code here.
-	//int count = 0;
-	/*for(int i = 0;i < 3;i++)
-	{
-		if (envs[i].env_status == ENV_RUNNABLE) cprintf("%08x ENV_RUNNABLE. ", envs + i);
-		if (envs[i].env_status == ENV_RUNNING) cprintf("%08x ENV_RUNNING. ", envs + i);
-		if (envs[i].env_status == ENV_NOT_RUNNABLE) cprintf("%08x ENV_NOT_RUNNABLE. ", envs + i);
-		cprintf("%d\n", envs[i].env_type);
-	}*/
-	//cprintf("ENV_RUNNABLE count: %d\n", count);
-	struct Env *it = envs, *end = envs + NENV;
-	if (curenv) 
-	{
-		it = curenv;
-		end = curenv;
-		++it;
-	}
-	while (it != end)
-	{
-		if (it >= envs + NENV)
-			it = envs;
-		if (it == end) break;
-		if (it->env_status == ENV_RUNNABLE)
-		{
-			//cprintf("envaddr: %08x\n", it);			
-			//cprintf ("at %s, line %d\n", __FILE__, __LINE__);
-			env_run(it);
-			return;
-		}
-		++it;
-		//cprintf("%x %x %x\n", (uint32_t)it, (uint32_t)(envs + NENV), (uint32_t) end);
-	}
 	if (curenv && curenv->env_status == ENV_RUNNING)
-	{
-		//cprintf("envaddr: %08x\n", curenv);
-		//cprintf ("at %s, line %d\n", __FILE__, __LINE__);
-		env_run(curenv);
-		return;
-	}
+		env_try_run(curenv);
+
 	// sched_halt never returns
 	sched_halt();
 }
 
-// Halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+// Halt this CPU when there is nothing to do.  Before halting, keep
+// looking for work to steal for a while, so that an idle CPU picks up
+// newly runnable environments without waiting for a timer interrupt.
+// Then wait until the timer interrupt wakes it up. This function never
+// returns.
 //
 void
 sched_halt(void)
 {
+	struct Env *e;
 	int i;
 
+	// Mark that no environment is running on this CPU
+	env_leave();
+
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
+	// Environments asleep on a wait queue count as runnable, since an
+	// interrupt or another CPU may yet wake them.
 	for (i = 0; i < NENV; i++) {
 		if ((envs[i].env_status == ENV_RUNNABLE ||
 		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
+		     envs[i].env_status == ENV_DYING ||
+		     envs[i].env_waitq))
 			break;
 	}
 	if (i == NENV) {
@@ -93,17 +244,28 @@ sched_halt(void)
 			monitor(NULL);
 	}
 
-	// Mark that no environment is running on this CPU
-	curenv = NULL;
-	lcr3(PADDR(kern_pgdir));
+	// Poll for work that other CPUs queue or can spare.  Meanwhile,
+	// put the idle time to use by zeroing free pages for later
+	// page_alloc(ALLOC_ZERO) calls.
+	for (i = 0; i < SCHED_IDLE_POLLS; i++) {
+		if ((e = rq_pop(&runqueues[cpunum()])) || (e = sched_steal()))
+			env_try_run(e);
+		tlb_shootdown_poll();
+		if (!page_zero_refill())
+			asm volatile("pause");
+	}
 
-	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
+	// Mark that this CPU is in the HALT state, so that other CPUs
+	// stop queueing environments here.
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
+	// Pick up anything that was queued here before other CPUs saw
+	// that we are halting.
+	while ((e = rq_pop(&runqueues[cpunum()]))) {
+		xchg(&thiscpu->cpu_status, CPU_STARTED);
+		env_try_run(e);
+		xchg(&thiscpu->cpu_status, CPU_HALTED);
+	}
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
@@ -116,5 +278,5 @@ sched_halt(void)
 		"hlt\n"
 		"jmp 1b\n"
 	: : "a" (thiscpu->cpu_ts.ts_esp0));
+	panic("hlt loop exited");  // mostly to placate the compiler
 }
-
@@ -6,6 +6,16 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+struct Env;
+
+void sched_init(void);
+
+// Run queue maintenance.  Every ENV_RUNNABLE environment sits on exactly
+// one CPU's run queue; callers must enqueue an environment whenever they
+// make it ENV_RUNNABLE and dequeue it when it stops being runnable.
+void sched_enqueue(struct Env *e);
+void sched_dequeue(struct Env *e);
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
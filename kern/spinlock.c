@@ -8,15 +8,13 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
+#include <kern/pmap.h>
 
-// The big kernel lock
-struct spinlock kernel_lock = {
 #ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
-#endif
-};
+// Every initialized lock, most recently initialized first, for
+// spin_print_stats.
+static struct spinlock *all_locks;
 
-#ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
 static void
 get_caller_pcs(uint32_t pcs[])
@@ -39,17 +37,23 @@ get_caller_pcs(uint32_t pcs[])
 static int
 holding(struct spinlock *lock)
 {
-	return lock->locked && lock->cpu == thiscpu;
+	return lock->next != lock->owner && lock->cpu == thiscpu;
 }
 #endif
 
+// Initialize lk.  Must be called exactly once per lock, before any
+// other CPU can use it; in practice during boot.
 void
 __spin_initlock(struct spinlock *lk, char *name)
 {
-	lk->locked = 0;
+	lk->next = lk->owner = 0;
 #ifdef DEBUG_SPINLOCK
 	lk->name = name;
 	lk->cpu = 0;
+	lk->nacquire = lk->ncontended = 0;
+	lk->spin_cycles = lk->max_hold = 0;
+	lk->stats_next = all_locks;
+	all_locks = lk;
 #endif
 }
 
@@ -60,19 +64,39 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+	uint32_t ticket;
 #ifdef DEBUG_SPINLOCK
+	uint64_t spin_start = 0;
+
 	if (holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
 #endif
 
-	// The xchg is atomic.
-	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	// The xadd is atomic, so every CPU gets a different ticket.
+	// Waiters only read 'owner', which changes once per release,
+	// instead of all retrying a locked write to the same line.
+	ticket = xadd(&lk->next, 1);
+	if (lk->owner != ticket) {
+#ifdef DEBUG_SPINLOCK
+		spin_start = read_tsc();
+#endif
+		// The holder may be waiting for us to flush our TLB.
+		while (lk->owner != ticket) {
+			tlb_shootdown_poll();
+			asm volatile ("pause");
+		}
+	}
+	// Keep gcc from moving the critical section above the wait.
+	asm volatile("" : : : "memory");
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
+	lk->acquire_tsc = read_tsc();
+	lk->nacquire++;
+	if (spin_start) {
+		lk->ncontended++;
+		lk->spin_cycles += lk->acquire_tsc - spin_start;
+	}
 	lk->cpu = thiscpu;
 	get_caller_pcs(lk->pcs);
 #endif
@@ -83,6 +107,8 @@ void
 spin_unlock(struct spinlock *lk)
 {
 #ifdef DEBUG_SPINLOCK
+	uint64_t held;
+
 	if (!holding(lk)) {
 		int i;
 		uint32_t pcs[10];
@@ -103,14 +129,63 @@ spin_unlock(struct spinlock *lk)
 		panic("spin_unlock");
 	}
 
+	held = read_tsc() - lk->acquire_tsc;
+	if (held > lk->max_hold)
+		lk->max_hold = held;
 	lk->pcs[0] = 0;
 	lk->cpu = 0;
 #endif
 
-	// The xchg instruction is atomic (i.e. uses the "lock" prefix) with
-	// respect to any other instruction which references the same memory.
-	// x86 CPUs will not reorder loads/stores across locked instructions
-	// (vol 3, 8.2.2). Because xchg() is implemented using asm volatile,
-	// gcc will not reorder C statements across the xchg.
-	xchg(&lk->locked, 0);
+	// Only the holder writes 'owner', so a plain increment hands
+	// the lock to the next ticket.  x86 does not reorder stores
+	// with older loads or stores (vol 3, 8.2.2), and the barrier
+	// keeps gcc from sinking the critical section below the release.
+	asm volatile("" : : : "memory");
+	lk->owner++;
+}
+
+// Print contention statistics for every lock.  Locks that were
+// initialized one after another under the same name, such as the
+// per-environment locks, are reported together as one line.
+void
+spin_print_stats(void)
+{
+#ifdef DEBUG_SPINLOCK
+	struct spinlock *lk, *run;
+	uint32_t nacquire, ncontended;
+	uint64_t spin_cycles, max_hold;
+
+	cprintf("%-20s %10s %10s %16s %12s\n", "lock", "acquired",
+		"contended", "spin cycles", "max hold");
+	for (lk = all_locks; lk; ) {
+		nacquire = ncontended = 0;
+		spin_cycles = max_hold = 0;
+		for (run = lk; lk && lk->name == run->name; lk = lk->stats_next) {
+			nacquire += lk->nacquire;
+			ncontended += lk->ncontended;
+			spin_cycles += lk->spin_cycles;
+			if (lk->max_hold > max_hold)
+				max_hold = lk->max_hold;
+		}
+		if (nacquire)
+			cprintf("%-20s %10u %10u %16llu %12llu\n", run->name,
+				nacquire, ncontended, spin_cycles, max_hold);
+	}
+#else
+	cprintf("Lock statistics need DEBUG_SPINLOCK\n");
+#endif
+}
+
+// Clear the contention statistics of every lock.
+void
+spin_reset_stats(void)
+{
+#ifdef DEBUG_SPINLOCK
+	struct spinlock *lk;
+
+	for (lk = all_locks; lk; lk = lk->stats_next) {
+		lk->nacquire = lk->ncontended = 0;
+		lk->spin_cycles = lk->max_hold = 0;
+	}
+#endif
 }
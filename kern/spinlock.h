@@ -6,9 +6,12 @@
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
 
-// Mutual exclusion lock.
+// Mutual exclusion lock.  A ticket lock: each CPU that wants the lock
+// takes the next ticket and waits until 'owner' reaches it, so CPUs
+// get the lock in the order they asked for it.
 struct spinlock {
-	unsigned locked;       // Is the lock held?
+	volatile uint32_t next;   // Next ticket to hand out
+	volatile uint32_t owner;  // Ticket now holding the lock
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
@@ -16,33 +19,23 @@ struct spinlock {
 	struct CpuInfo *cpu;   // The CPU holding the lock.
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
+
+	// Contention statistics, updated by the holder (see lockstat).
+	uint32_t nacquire;     // Number of acquisitions
+	uint32_t ncontended;   // Acquisitions that had to wait
+	uint64_t spin_cycles;  // Total cycles spent waiting
+	uint64_t max_hold;     // Longest time the lock was held, in cycles
+	uint64_t acquire_tsc;  // When the current holder got the lock
+	struct spinlock *stats_next;	// Next lock in the list of all locks
 #endif
 };
 
 void __spin_initlock(struct spinlock *lk, char *name);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+void spin_print_stats(void);
+void spin_reset_stats(void);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
 
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
-
-static inline void
-unlock_kernel(void)
-{
-	spin_unlock(&kernel_lock);
-
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
-}
-
 #endif
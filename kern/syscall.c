@@ -4,6 +4,7 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/ring.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
@@ -11,6 +12,8 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/waitq.h>
+#include <kern/ipc.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -22,12 +25,17 @@ sys_cputs(const char *s, size_t len)
 	// Destroy the environment if not.
 
 	// LAB 3: Your code here.
-	if (user_mem_check(curenv, s, len, PTE_U | PTE_P) == 0)
+	int r;
+
+	// Keep the string mapped while we print it.
+	spin_lock(env_vm_lock(curenv));
+	if ((r = user_mem_check(curenv, s, len, PTE_U | PTE_P)) == 0)
 	{
 		// Print the string supplied by the user.
 		cprintf("%.*s", len, s);
 	}
-	else
+	spin_unlock(env_vm_lock(curenv));
+	if (r < 0)
 	{
 		user_mem_assert(curenv, s, len, PTE_U | PTE_P);
 	}
@@ -41,6 +49,15 @@ sys_cgetc(void)
 	return cons_getc();
 }
 
+// Read a character from the system console, sleeping until one arrives
+// if none is waiting.  Returns the character, or 0 after sleeping, in
+// which case the caller should try again.
+static int
+sys_cgetc_wait(void)
+{
+	return cons_getc_wait();
+}
+
 // Returns the current environment's envid.
 static envid_t
 sys_getenvid(void)
@@ -59,9 +76,9 @@ sys_env_destroy(envid_t envid)
 	int r;
 	struct Env *e;
 
-	if ((r = envid2env(envid, &e, 1)) < 0)
+	if ((r = envid2env_lock(envid, &e, 1)) < 0)
 		return r;
-	env_destroy(e);
+	env_destroy_locked(e);
 	return 0;
 }
 
@@ -80,8 +97,8 @@ static envid_t
 sys_exofork(void)
 {
 	// Create the new environment with env_alloc(), from kern/env.c.
-	// It should be left as env_alloc created it, except that
-	// status is set to ENV_NOT_RUNNABLE, and the register set is copied
+	// It should be left as env_alloc created it, ENV_NOT_RUNNABLE,
+	// except that the register set is copied
 	// from the current environment -- but tweaked so sys_exofork
 	// will appear to return 0.
 
@@ -90,8 +107,7 @@ sys_exofork(void)
 	int error_code;
 	if ((error_code = env_alloc(&e, curenv->env_id)) < 0)
 		return error_code;
-	e->env_status = ENV_NOT_RUNNABLE;
-	e->env_tf = curenv->env_tf;
+	e->env_tf = *env_cur_tf();
 	e->env_tf.tf_regs.reg_eax = 0;
 	return e->env_id;
 }
@@ -114,12 +130,27 @@ sys_env_set_status(envid_t envid, int status)
 
 	// LAB 4: Your code here.
 	struct Env *e;
-	int error_code = envid2env(envid, &e, 1);
+	if (status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE)
+		return -E_INVAL;
+	// An env made runnable by hand stops sleeping on its wait queue.
+	if (status == ENV_RUNNABLE && envid2env(envid, &e, 1) == 0)
+		waitq_cancel(e);
+	int error_code = envid2env_lock(envid, &e, 1);
 	if (error_code < 0) return error_code;
-	if (e->env_status == ENV_RUNNABLE || e->env_status == ENV_NOT_RUNNABLE)
+	if (e->env_status != ENV_RUNNABLE && e->env_status != ENV_NOT_RUNNABLE)
+		error_code = -E_INVAL;
+	else if (status == ENV_RUNNABLE)
+	{
 		e->env_status = status;
-	else return -E_INVAL;
-	return 0;
+		sched_enqueue(e);
+	}
+	else
+	{
+		sched_dequeue(e);
+		e->env_status = status;
+	}
+	spin_unlock(env_lock(e));
+	return error_code;
 }
 
 // Set envid's trap frame to 'tf'.
@@ -136,11 +167,29 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	// Remember to check whether the user has supplied us with a good
 	// address!
 	struct Env *e;
-	int error_code = envid2env(envid, &e, 1);
+	struct Trapframe ktf;
+	int error_code;
+
+	// tf lives in our own address space; copy it out while it is
+	// sure to stay mapped.
+	spin_lock(env_vm_lock(curenv));
+	error_code = user_mem_check(curenv, tf, sizeof(struct Trapframe), PTE_U);
+	if (error_code == 0)
+		ktf = *tf;
+	spin_unlock(env_vm_lock(curenv));
+	if (error_code < 0) {
+		user_mem_assert(curenv, tf, sizeof(struct Trapframe), PTE_U);
+		return error_code;
+	}
+
+	error_code = envid2env_lock(envid, &e, 1);
 	if (error_code < 0) return error_code;
-	user_mem_assert(e, tf, sizeof(struct Trapframe), PTE_U);
-	e->env_tf = *tf;
+	e->env_tf = ktf;
 	e->env_tf.tf_eflags |= FL_IF;
+	// The new registers replace those curenv trapped with.
+	if (e == curenv)
+		thiscpu->cpu_tf = NULL;
+	spin_unlock(env_lock(e));
 	//e->env_tf.tf_eflags &= ~FL_IOPL_3;
 	//e->env_tf.tf_cs = GD_UT | 3;
 	return 0;
@@ -159,9 +208,10 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 {
 	// LAB 4: Your code here.
 	struct Env *e;
-	int error_code = envid2env(envid, &e, 1);
+	int error_code = envid2env_lock(envid, &e, 1);
 	if (error_code < 0) return error_code;
 	e->env_pgfault_upcall = func;
+	spin_unlock(env_lock(e));
 	return 0;
 }
 
@@ -170,6 +220,84 @@ static bool check_for_va(void *va)
 {
 	return (uint32_t) va >= UTOP || ((uint32_t) va & (PGSIZE - 1));
 }
+
+// Lock the address spaces of a and b, which may be the same
+// environment, in envs[] order, and check that they still are the
+// environments named aid and bid.  Returns -E_BAD_ENV, with nothing
+// locked, if either one has been freed since it was looked up.
+static int
+env_vm_lock_pair(struct Env *a, envid_t aid, struct Env *b, envid_t bid)
+{
+	spin_lock(env_vm_lock(a < b ? a : b));
+	if (a != b)
+		spin_lock(env_vm_lock(a < b ? b : a));
+	if (a->env_id != aid || !a->env_pgdir
+	    || b->env_id != bid || !b->env_pgdir) {
+		spin_unlock(env_vm_lock(a));
+		if (a != b)
+			spin_unlock(env_vm_lock(b));
+		return -E_BAD_ENV;
+	}
+	return 0;
+}
+
+static void
+env_vm_unlock_pair(struct Env *a, struct Env *b)
+{
+	spin_unlock(env_vm_lock(a));
+	if (a != b)
+		spin_unlock(env_vm_lock(b));
+}
+
+// Create a copy of the current environment, as fork() does, in one
+// system call.  The child gets copy-on-write mappings of the caller's
+// pages below USTACKTOP (see pgdir_fork), a fresh user exception stack
+// if the caller has one, and the caller's registers and page fault
+// upcall.  It is made runnable right away and sees 0 as the return
+// value.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static int
+sys_fork(void)
+{
+	struct Env *e;
+	struct PageInfo *pp;
+	void *uxstack = (void *) (UXSTACKTOP - PGSIZE);
+	int r;
+
+	if ((r = env_alloc(&e, curenv->env_id)) < 0)
+		return r;
+	e->env_tf = *env_cur_tf();
+	e->env_tf.tf_regs.reg_eax = 0;
+	e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+
+	if ((r = env_vm_lock_pair(curenv, curenv->env_id, e, e->env_id)) < 0)
+		goto fail;
+	r = pgdir_fork(e->env_pgdir, curenv->env_pgdir, USTACKTOP);
+	if (r == 0 && page_lookup(curenv->env_pgdir, uxstack, NULL)) {
+		if (!(pp = page_alloc(ALLOC_ZERO)))
+			r = -E_NO_MEM;
+		else if ((r = page_insert(e->env_pgdir, pp, uxstack,
+					  PTE_P | PTE_U | PTE_W)) < 0)
+			page_free(pp);
+	}
+	env_vm_unlock_pair(curenv, e);
+	if (r < 0)
+		goto fail;
+
+	spin_lock(env_lock(e));
+	e->env_status = ENV_RUNNABLE;
+	sched_enqueue(e);
+	spin_unlock(env_lock(e));
+	return e->env_id;
+
+fail:
+	env_destroy(e);
+	return r;
+}
+
 // Allocate a page of memory and map it at 'va' with permission
 // 'perm' in the address space of 'envid'.
 // The page's contents are set to 0.
@@ -203,9 +331,15 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	if (check_for_va(va)) return -E_INVAL;
 	if ((perm & PTE_U) == 0 || (perm & PTE_P) == 0) return -E_INVAL;
 	if (perm & ~(PTE_U | PTE_P | PTE_AVAIL | PTE_W)) return -E_INVAL;
+	// Zero the page before taking any locks.
 	struct PageInfo * page = page_alloc(ALLOC_ZERO);
 	if (page == NULL) return -E_NO_MEM;
-	error_code = page_insert(e->env_pgdir, page, va, perm);
+	error_code = envid2env_vm_lock(envid, &e, 1);
+	if (error_code == 0)
+	{
+		error_code = page_insert(e->env_pgdir, page, va, perm);
+		spin_unlock(env_vm_lock(e));
+	}
 	if (error_code < 0) 
 	{
 		page_free(page);
@@ -214,6 +348,29 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	return 0;
 }
 
+// Map the page at 'srcva' in src's address space at 'dstva' in dst's,
+// for sys_page_map and sys_page_mapv.  Both address spaces must be
+// locked.  Invalidations of old mappings at dstva go to 'tb'.
+static int
+page_map_locked(struct Env *src, void *srcva, struct Env *dst, void *dstva,
+		int perm, struct tlb_batch *tb)
+{
+	pte_t *pgtable;
+	struct PageInfo *page;
+
+	if (check_for_va(srcva) || check_for_va(dstva)) return -E_INVAL;
+	if ((perm & PTE_U) == 0 || (perm & PTE_P) == 0) return -E_INVAL;
+	if (perm & ~(PTE_U | PTE_P | PTE_AVAIL | PTE_W)) return -E_INVAL;
+	// A shared page table's writable pages are really copy-on-write.
+	if ((perm & PTE_W) && pgdir_unshare(src->env_pgdir, srcva) < 0)
+		return -E_NO_MEM;
+	if ((page = page_lookup(src->env_pgdir, srcva, &pgtable)) == NULL)
+		return -E_INVAL;
+	if ((perm & PTE_W) && !(*pgtable & PTE_W))
+		return -E_INVAL;
+	return page_insert_batch(dst->env_pgdir, page, dstva, perm, tb);
+}
+
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
@@ -234,31 +391,125 @@ static int
 sys_page_map(envid_t srcenvid, void *srcva,
 	     envid_t dstenvid, void *dstva, int perm)
 {
-	// Hint: This function is a wrapper around page_lookup() and
-	//   page_insert() from kern/pmap.c.
-	//   Again, most of the new code you write should be to check the
-	//   parameters for correctness.
-	//   Use the third argument to page_lookup() to
-	//   check the current permissions on the page.
-
-	// LAB 4: Your code here.
 	struct Env *src, *dst;
+	struct tlb_batch tb;
 	int error_code = envid2env(srcenvid, &src, 1);
 	if (error_code < 0) return error_code;
 	error_code = envid2env(dstenvid, &dst, 1);
 	if (error_code < 0) return error_code;
-	if (check_for_va(srcva) || check_for_va(dstva)) return -E_INVAL;
+	error_code = env_vm_lock_pair(src, srcenvid ? srcenvid : curenv->env_id,
+				      dst, dstenvid ? dstenvid : curenv->env_id);
+	if (error_code < 0) return error_code;
+	tlb_batch_init(&tb, dst->env_pgdir);
+	error_code = page_map_locked(src, srcva, dst, dstva, perm, &tb);
+	tlb_batch_flush(&tb);
+	env_vm_unlock_pair(src, dst);
+	return error_code;
+}
+
+// Copy 'len' bytes at 'uva' in curenv's address space into 'dst',
+// holding curenv's address-space lock so that no other environment can
+// unmap the memory between the check and the copy.  If curenv may not
+// read the memory, destroys it as user_mem_assert does.
+// Returns 0 on success, < 0 on error.
+static int
+copy_from_user(void *dst, const void *uva, size_t len)
+{
+	int r;
+
+	spin_lock(env_vm_lock(curenv));
+	if ((r = user_mem_check(curenv, uva, len, PTE_U)) == 0)
+		memcpy(dst, uva, len);
+	spin_unlock(env_vm_lock(curenv));
+	if (r < 0)
+		user_mem_assert(curenv, uva, len, PTE_U);
+	return r;
+}
+
+// Map the 'n' pages described by 'v' from srcenvid's address space
+// into dstenvid's, as sys_page_map does for each entry in turn, but
+// with one environment lookup, one lock acquisition and one TLB flush
+// for the whole vector.
+//
+// Returns the number of entries mapped, which is less than n if entry
+// v[returned value] failed; the mappings before it stay in place.  If
+// the first entry fails, returns its error (see sys_page_map).  Also:
+//	-E_INVAL if n < 0 or n > PAGEV_MAX.
+static int
+sys_page_mapv(envid_t srcenvid, envid_t dstenvid,
+	      const struct PageMap *uv, int n)
+{
+	struct PageMap v[PAGEV_MAX];
+	struct Env *src, *dst;
+	struct tlb_batch tb;
+	int i, r = 0;
+
+	if (n < 0 || n > PAGEV_MAX)
+		return -E_INVAL;
+	if ((r = copy_from_user(v, uv, n * sizeof(v[0]))) < 0)
+		return r;
+
+	if ((r = envid2env(srcenvid, &src, 1)) < 0
+	    || (r = envid2env(dstenvid, &dst, 1)) < 0)
+		return r;
+	r = env_vm_lock_pair(src, srcenvid ? srcenvid : curenv->env_id,
+			     dst, dstenvid ? dstenvid : curenv->env_id);
+	if (r < 0)
+		return r;
+	tlb_batch_init(&tb, dst->env_pgdir);
+	for (i = 0; i < n; i++)
+		if ((r = page_map_locked(src, v[i].pm_srcva, dst, v[i].pm_dstva,
+					 v[i].pm_perm, &tb)) < 0)
+			break;
+	tlb_batch_flush(&tb);
+	env_vm_unlock_pair(src, dst);
+	return i ? i : r;
+}
+
+// Check that [va, va + npages * PGSIZE) is a page-aligned range below
+// UTOP.
+static bool
+check_range(void *va, int npages)
+{
+	return !check_for_va(va) && npages >= 0
+		&& npages <= (UTOP - (uint32_t) va) / PGSIZE;
+}
+
+// Allocate 'npages' zeroed pages and map them at the consecutive pages
+// from 'va' in envid's address space, as sys_page_alloc does for each.
+//
+// Returns the number of pages mapped, which is less than npages if the
+// next one failed; the pages before it stay mapped.  If the first page
+// fails, returns its error (see sys_page_alloc).  Also:
+//	-E_INVAL if the range does not lie below UTOP.
+static int
+sys_page_alloc_range(envid_t envid, void *va, int npages, int perm)
+{
+	struct Env *e;
+	struct PageInfo *pp;
+	struct tlb_batch tb;
+	int i, r = 0;
+
+	if (!check_range(va, npages)) return -E_INVAL;
 	if ((perm & PTE_U) == 0 || (perm & PTE_P) == 0) return -E_INVAL;
 	if (perm & ~(PTE_U | PTE_P | PTE_AVAIL | PTE_W)) return -E_INVAL;
-	pte_t *pgtable;
-	struct PageInfo * page = page_lookup(src->env_pgdir, srcva, &pgtable);
-	if (page == NULL) return -E_INVAL;
-	if ((perm & PTE_W) && !(*pgtable & PTE_W)) return -E_INVAL;
-	error_code = page_insert(dst->env_pgdir, page, dstva, perm);
-	if (error_code < 0) return error_code;
-	// if (dstenvid == 0 && (uint32_t) srcva == 0xeebfd000)
-	// 	panic("panic");
-	return 0;
+	if ((r = envid2env_vm_lock(envid, &e, 1)) < 0)
+		return r;
+	tlb_batch_init(&tb, e->env_pgdir);
+	for (i = 0; i < npages; i++) {
+		if (!(pp = page_alloc(ALLOC_ZERO))) {
+			r = -E_NO_MEM;
+			break;
+		}
+		if ((r = page_insert_batch(e->env_pgdir, pp,
+					   va + i * PGSIZE, perm, &tb)) < 0) {
+			page_free(pp);
+			break;
+		}
+	}
+	tlb_batch_flush(&tb);
+	spin_unlock(env_vm_lock(e));
+	return i ? i : r;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -268,6 +519,8 @@ sys_page_map(envid_t srcenvid, void *srcva,
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_NO_MEM if the page table is shared since fork and there's no
+//		memory to copy it.
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -275,19 +528,259 @@ sys_page_unmap(envid_t envid, void *va)
 
 	// LAB 4: Your code here.
 	struct Env *e;
-	int error_code = envid2env(envid, &e, 1);
-	if (error_code < 0) return error_code;
+	struct PageInfo *pp;
+	pte_t *pte;
+	physaddr_t shared = 0;
 	if (check_for_va(va)) return -E_INVAL;
-	page_remove(e->env_pgdir, va);
+	int error_code = envid2env_vm_lock(envid, &e, 1);
+	if (error_code < 0) return error_code;
+	if ((pp = page_lookup(e->env_pgdir, va, &pte)) && (*pte & PTE_SHARE))
+		shared = page2pa(pp);
+	error_code = page_remove(e->env_pgdir, va);
+	spin_unlock(env_vm_lock(e));
+	// Envs sharing the page may sleep until it is let go of (see
+	// devpipe_read), so wake them now that its pp_ref has dropped.
+	if (shared && error_code == 0)
+		futex_wake_page(shared);
+	return error_code;
+}
+
+// Unmap the 'npages' consecutive pages from 'va' in envid's address
+// space, with one TLB flush for the whole range.  Unmapped pages in the
+// range are skipped.
+//
+// Returns npages, or fewer if unmapping the next page failed; the pages
+// before it stay unmapped.  Errors, if the first page fails, are those
+// of sys_page_unmap, and also:
+//	-E_INVAL if the range does not lie below UTOP.
+static int
+sys_page_unmap_range(envid_t envid, void *va, int npages)
+{
+	struct Env *e;
+	struct PageInfo *pp;
+	struct tlb_batch tb;
+	pte_t *pte;
+	bool shared = false;
+	int i, r = 0;
+
+	if (!check_range(va, npages)) return -E_INVAL;
+	if ((r = envid2env_vm_lock(envid, &e, 1)) < 0)
+		return r;
+	tlb_batch_init(&tb, e->env_pgdir);
+	for (i = 0; i < npages; i++) {
+		if ((pp = page_lookup(e->env_pgdir, va + i * PGSIZE, &pte))
+		    && (*pte & PTE_SHARE))
+			shared = true;
+		if ((r = page_remove_batch(e->env_pgdir, va + i * PGSIZE, &tb)) < 0)
+			break;
+	}
+	tlb_batch_flush(&tb);
+	spin_unlock(env_vm_lock(e));
+	// As in sys_page_unmap, but there may be many pages to wake.
+	if (shared)
+		futex_wake_all();
+	return i ? i : r;
+}
+
+// Check the page-transfer arguments of an IPC send: if srcva < UTOP it
+// must be page-aligned and perm must be as for sys_page_alloc.
+static int
+ipc_check_perm(void *srcva, unsigned perm)
+{
+	if ((uint32_t) srcva >= UTOP)
+		return 0;
+	if ((uint32_t)srcva & (PGSIZE - 1)) return -E_INVAL;
+	if ((perm & PTE_U) == 0 || (perm & PTE_P) == 0) return -E_INVAL;
+	if (perm & ~(PTE_U | PTE_P | PTE_AVAIL | PTE_W)) return -E_INVAL;
+	return 0;
+}
+
+// Check a receive window of 'npages' pages at 'dstva', which is
+// ignored if dstva >= UTOP.
+static bool
+ipc_check_window(void *dstva, int npages)
+{
+	return (uint32_t) dstva >= UTOP || check_range(dstva, npages);
+}
+
+// Find the page at 'srcva' in curenv's address space that an IPC send
+// grants with 'perm'.  curenv's address space must be locked.
+static int
+ipc_lookup_page(void *srcva, unsigned perm, struct PageInfo **pp)
+{
+	pte_t *pgtable;
+
+	// A shared page table's writable pages are really
+	// copy-on-write.
+	if ((perm & PTE_W)
+	    && pgdir_unshare(curenv->env_pgdir, srcva) < 0)
+		return -E_NO_MEM;
+	if (!(*pp = page_lookup(curenv->env_pgdir, srcva, &pgtable)))
+		return -E_INVAL;
+	if ((perm & PTE_W) && !(*pgtable & PTE_W))
+		return -E_INVAL;
+	return 0;
+}
+
+// Map the first of 'npages' granted pages that fit e's receive window
+// at 'dstva', which is 'window' pages long.  e's address space must be
+// locked.  Returns the number of pages mapped, or < 0 on error, in
+// which case some of the pages may stay mapped.
+static int
+ipc_map_window(struct Env *e, void *dstva, int window,
+	       struct PageInfo **pages, int npages, unsigned perm)
+{
+	struct tlb_batch tb;
+	int i, r = 0;
+
+	if ((uint32_t) dstva >= UTOP)
+		return 0;
+	npages = MIN(npages, window);
+	tlb_batch_init(&tb, e->env_pgdir);
+	for (i = 0; i < npages; i++)
+		if ((r = page_insert_batch(e->env_pgdir, pages[i],
+					   dstva + i * PGSIZE, perm, &tb)) < 0)
+			break;
+	tlb_batch_flush(&tb);
+	return r < 0 ? r : npages;
+}
+
+// Fill in a message from curenv carrying 'value' and granting the
+// 'npages' pages in 'pages' with 'perm'.
+static void
+ipc_msg_init(struct IpcMsg *m, uint32_t value, struct PageInfo **pages,
+	     int npages, unsigned perm)
+{
+	m->im_next = NULL;
+	m->im_from = curenv->env_id;
+	m->im_value = value;
+	m->im_handle = 0;
+	m->im_perm = npages ? perm : 0;
+	m->im_npages = npages;
+	m->im_pages = pages;
+	m->im_page = NULL;
+}
+
+// Whether e is blocked receiving and takes messages from 'from'.
+// env_lock(e) must be held.
+static bool
+ipc_receiving(struct Env *e, envid_t from)
+{
+	return e->env_status == ENV_NOT_RUNNABLE && e->env_ipc_recving
+		&& ipc_accepts(e, from);
+}
+
+// Deliver the IPC message 'msg' from curenv to e, which must be envid.
+// If e is blocked in sys_ipc_recv or sys_ipc_call, and takes messages
+// from curenv, hand the message over directly: e becomes ENV_RUNNABLE
+// but is not yet on a run queue, so the caller can either queue it or
+// switch to it.  Otherwise queue the message for a later receive.  The
+// caller holds env_lock(e) and, if the message grants pages, both
+// address spaces' locks.
+//
+// Returns 0 if the message was handed over, 1 if it was queued, or < 0
+// on error (see sys_ipc_try_send).
+static int
+ipc_deliver(struct Env *e, envid_t envid, const struct IpcMsg *msg)
+{
+	int n;
+
+	if (e->env_id != envid)
+		return -E_BAD_ENV;
+	if (!ipc_receiving(e, curenv->env_id)) {
+		if ((n = ipcq_push(e, msg)) < 0)
+			return n;
+		return 1;
+	}
+	if ((n = ipc_map_window(e, e->env_ipc_dstva, e->env_ipc_npages,
+				msg->im_pages, msg->im_npages,
+				msg->im_perm)) < 0)
+		return n;
+	e->env_ipc_npages = n;
+	e->env_ipc_perm = n ? msg->im_perm : 0;
+	e->env_ipc_recving = 0;
+	e->env_ipc_nfrom = 0;
+	e->env_ipc_callee = 0;
+	e->env_ipc_from = msg->im_from;
+	e->env_ipc_value = msg->im_value;
+	e->env_ipc_handle = msg->im_handle;
+	e->env_status = ENV_RUNNABLE;
+	e->env_tf.tf_regs.reg_eax = 0;
+	return 0;
+}
+
+// Start a receive by curenv into the window of 'npages' pages at
+// 'dstva', from the senders curenv's sender set names.  If one of them
+// has a message queued, take the oldest such message off the queue and
+// return it.  Otherwise mark curenv blocked receiving and return NULL;
+// the caller then gives up the CPU.  env_lock(curenv) must be held.
+static struct IpcMsg *
+ipc_recv_locked(void *dstva, int npages)
+{
+	struct IpcMsg *m;
+
+	if ((m = ipcq_pop(curenv))) {
+		curenv->env_ipc_nfrom = 0;
+		return m;
+	}
+	// The sender sets our return value in env_tf.
+	env_save_tf();
+	curenv->env_ipc_from = 0;
+	curenv->env_ipc_recving = 1;
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_npages = npages;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	return NULL;
+}
+
+// Receive the queued message m, which curenv has taken off its own
+// queue, as if it had been sent to curenv blocked in sys_ipc_recv with
+// a window of 'window' pages at 'dstva'.  If the granted pages cannot
+// be mapped, the message arrives without them.  Returns 0, the value
+// sys_ipc_recv returns.
+static int
+ipc_take(struct IpcMsg *m, void *dstva, int window)
+{
+	int n;
+
+	curenv->env_ipc_from = m->im_from;
+	curenv->env_ipc_value = m->im_value;
+	curenv->env_ipc_handle = m->im_handle;
+	spin_lock(env_vm_lock(curenv));
+	n = ipc_map_window(curenv, dstva, window, m->im_pages,
+			   m->im_npages, m->im_perm);
+	spin_unlock(env_vm_lock(curenv));
+	curenv->env_ipc_npages = MAX(n, 0);
+	curenv->env_ipc_perm = n > 0 ? m->im_perm : 0;
+	ipcq_free(m);
+	// Senders that found the queue full sleep on env_ipc_queued.
+	futex_wake(PADDR(&curenv->env_ipc_queued), NENV);
 	return 0;
 }
 
+// Take the env_locks of curenv and e, which differ, in envs[] order.
+static void
+ipc_lock_pair(struct Env *e)
+{
+	spin_lock(env_lock(curenv < e ? curenv : e));
+	spin_lock(env_lock(curenv < e ? e : curenv));
+}
+
+static void
+ipc_unlock_pair(struct Env *e)
+{
+	spin_unlock(env_lock(curenv));
+	spin_unlock(env_lock(e));
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
 //
-// The send fails with a return value of -E_IPC_NOT_RECV if the
-// target is not blocked, waiting for an IPC.
+// If the target is not blocked, waiting for an IPC from us, the
+// message (and the page, by reference) is queued for the target's next
+// sys_ipc_recv, up to ENV_IPCQ_MAX messages; the send fails with
+// -E_IPC_NOT_RECV only if the target's queue is full.
 //
 // The send also can fail for the other reasons listed below.
 //
@@ -296,7 +789,9 @@ sys_page_unmap(envid_t envid, void *va)
 //    env_ipc_recving is set to 0 to block future sends;
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise;
+//    env_ipc_npages is set to the number of pages transferred;
+//    env_ipc_handle is set to 0, since no reply is awaited.
 // The target environment is marked runnable again, returning 0
 // from the paused sys_ipc_recv system call.  (Hint: does the
 // sys_ipc_recv function ever actually return?)
@@ -309,8 +804,9 @@ sys_page_unmap(envid_t envid, void *va)
 // Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist.
 //		(No need to check permissions.)
-//	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
-//		or another environment managed to send first.
+//	-E_BAD_ENV if envid is being destroyed.
+//	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv
+//		and already has ENV_IPCQ_MAX messages queued.
 //	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
@@ -319,71 +815,520 @@ sys_page_unmap(envid_t envid, void *va)
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
 //		current environment's address space.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
-//		address space.
+//		address space, or to queue the message.
 static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	// LAB 4: Your code here.
 	struct Env *e;
+	struct IpcMsg msg;
+	struct PageInfo *page = NULL;
+	int npages = ((uint32_t) srcva < UTOP);
 	int error_code = envid2env(envid, &e, 0);
 	if (error_code < 0) return error_code;
-	//cprintf("try send env %08x\n", e);
-	if (e->env_ipc_recving == 0) return -E_IPC_NOT_RECV;
-	if ((uint32_t) srcva < UTOP)
-	{
-		if ((uint32_t)srcva & (PGSIZE - 1)) return -E_INVAL;
-		if ((perm & PTE_U) == 0 || (perm & PTE_P) == 0) return -E_INVAL;
-		if (perm & ~(PTE_U | PTE_P | PTE_AVAIL | PTE_W)) return -E_INVAL;
-		pte_t *pgtable;
-		struct PageInfo * page = page_lookup(curenv->env_pgdir, srcva, &pgtable);
-		if (page == NULL) return -E_INVAL;
-		if ((perm & PTE_W) && !(*pgtable & PTE_W)) return -E_INVAL;
-		if ((uint32_t) e->env_ipc_perm < UTOP)
-		{
-			error_code = page_insert(e->env_pgdir, page, e->env_ipc_dstva, perm);
-			if (error_code < 0) return error_code;
-			e->env_ipc_perm = perm;
-		}
-		else e->env_ipc_perm = 0;
+	envid = envid ? envid : curenv->env_id;
+	if ((error_code = ipc_check_perm(srcva, perm)) < 0)
+		return error_code;
+	// Both address spaces must be locked before e's IPC state.
+	if (npages) {
+		if ((error_code = env_vm_lock_pair(curenv, curenv->env_id, e, envid)) < 0)
+			return error_code;
+		if ((error_code = ipc_lookup_page(srcva, perm, &page)) < 0)
+			goto out;
 	}
-	else e->env_ipc_perm = 0;
-	e->env_ipc_recving = 0;
-	e->env_ipc_from = curenv->env_id;
-	/*cprintf("value: %d\n", value);
-	cprintf("env: %08x\n", e);
-	cprintf ("at %s, line %d\n", __FILE__, __LINE__);*/
-	e->env_ipc_value = value;
-	e->env_status = ENV_RUNNABLE;
-	e->env_tf.tf_regs.reg_eax = 0;
-	return 0;
+	ipc_msg_init(&msg, value, &page, npages, perm);
+	spin_lock(env_lock(e));
+	if ((error_code = ipc_deliver(e, envid, &msg)) == 0)
+		sched_enqueue(e);
+	spin_unlock(env_lock(e));
+out:
+	if (npages)
+		env_vm_unlock_pair(curenv, e);
+	return error_code < 0 ? error_code : 0;
+}
+
+// Send 'value' to 'envid' along with every page of the 'nsegs' ranges
+// in 'segs', as sys_ipc_try_send does with one page.  The pages are
+// mapped, in order, at consecutive pages of the window the receiver
+// gave sys_ipc_recv; pages that do not fit in the window are not
+// transferred.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_try_send, for each page, and also:
+//	-E_INVAL if nsegs < 1 or nsegs > IPCV_MAX.
+//	-E_INVAL if a range does not lie below UTOP, or the ranges hold
+//		more than IPC_PAGES_MAX pages in all.
+static int
+sys_ipc_try_sendv(envid_t envid, uint32_t value, const struct IpcSeg *usegs,
+		  int nsegs, unsigned perm)
+{
+	struct IpcSeg segs[IPCV_MAX];
+	struct IpcMsg msg;
+	struct PageInfo *arr, **pages;
+	struct Env *e;
+	int i, j, n = 0, r;
+
+	if (nsegs < 1 || nsegs > IPCV_MAX)
+		return -E_INVAL;
+	if ((r = copy_from_user(segs, usegs, nsegs * sizeof(segs[0]))) < 0)
+		return r;
+	for (i = 0; i < nsegs; i++) {
+		if (!check_range(segs[i].is_va, segs[i].is_npages)
+		    || segs[i].is_npages > IPC_PAGES_MAX - n)
+			return -E_INVAL;
+		n += segs[i].is_npages;
+	}
+	if ((r = ipc_check_perm(segs[0].is_va, perm)) < 0)
+		return r;
+	if ((r = envid2env(envid, &e, 0)) < 0)
+		return r;
+	envid = e->env_id;
+
+	// The list of pages to grant fills up to a page of its own.
+	static_assert(IPC_PAGES_MAX * sizeof(struct PageInfo *) <= PGSIZE);
+	if (!(arr = page_alloc(0)))
+		return -E_NO_MEM;
+	pages = page2kva(arr);
+	if ((r = env_vm_lock_pair(curenv, curenv->env_id, e, envid)) < 0)
+		goto out;
+	for (i = 0, n = 0; i < nsegs && r == 0; i++)
+		for (j = 0; j < segs[i].is_npages && r == 0; j++, n++)
+			r = ipc_lookup_page(segs[i].is_va + j * PGSIZE, perm,
+					    &pages[n]);
+	if (r == 0) {
+		ipc_msg_init(&msg, value, pages, n, perm);
+		spin_lock(env_lock(e));
+		if ((r = ipc_deliver(e, envid, &msg)) == 0)
+			sched_enqueue(e);
+		spin_unlock(env_lock(e));
+	}
+	env_vm_unlock_pair(curenv, e);
+out:
+	page_free(arr);
+	return r < 0 ? r : 0;
 }
 
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
 //
-// If 'dstva' is < UTOP, then you are willing to receive a page of data.
-// 'dstva' is the virtual address at which the sent page should be mapped.
+// If 'dstva' is < UTOP, then you are willing to receive up to 'npages'
+// pages of data.  'dstva' is the virtual address at which the first
+// sent page should be mapped; the rest follow it.
+//
+// If 'nfrom' > 0, receive only from the environments named in
+// from[0..nfrom-1] (a closed receive); messages from anyone else stay
+// queued for a later receive.
 //
-// This function only returns on error, but the system call will eventually
-// return 0 on success.
+// If messages were queued while we were not receiving, take the oldest
+// acceptable one and return 0 at once.  Otherwise this function only
+// returns on error, but the system call will eventually return 0 on
+// success.
 // Return < 0 on error.  Errors are:
-//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned, or the
+//		window of npages pages does not lie below UTOP.
+//	-E_INVAL if nfrom < 0 or nfrom > ENV_IPC_FROM_MAX.
+//	-E_BAD_ENV if nfrom > 0 and none of the environments in 'from'
+//		exists, or the last of them is freed while we wait.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, int npages, const envid_t *ufrom, int nfrom)
 {
 	// LAB 4: Your code here.
-	if ((uint32_t)dstva < UTOP && ((uint32_t)dstva & (PGSIZE - 1)))
+	envid_t from[ENV_IPC_FROM_MAX];
+	struct IpcMsg *m;
+	struct Env *e;
+	int i, r, alive = 0;
+
+	if (!ipc_check_window(dstva, npages))
+		return -E_INVAL;
+	if (nfrom < 0 || nfrom > ENV_IPC_FROM_MAX)
 		return -E_INVAL;
+	if (nfrom && (r = copy_from_user(from, ufrom,
+					 nfrom * sizeof(from[0]))) < 0)
+		return r;
+
 	//cprintf("I'm recving --- env %08x\n", curenv);
-	curenv->env_ipc_from = 0;
-	curenv->env_ipc_recving = 1;
-	curenv->env_ipc_dstva = dstva;
-	curenv->env_status = ENV_NOT_RUNNABLE;
+	spin_lock(env_lock(curenv));
+	// env_free takes dead senders out of the set only once we are
+	// receiving, so look for live ones after the set is in place.
+	curenv->env_ipc_nfrom = nfrom;
+	memcpy(curenv->env_ipc_from_set, from, nfrom * sizeof(from[0]));
+	for (i = 0; i < nfrom; i++)
+		if (envid2env(from[i], &e, 0) == 0 && e != curenv
+		    && e->env_status != ENV_FREE)
+			alive++;
+	// Take the oldest message that arrived while we were busy.
+	if ((m = ipcq_pop(curenv)))
+		curenv->env_ipc_nfrom = 0;
+	else if (nfrom && !alive) {
+		curenv->env_ipc_nfrom = 0;
+		spin_unlock(env_lock(curenv));
+		return -E_BAD_ENV;
+	} else
+		m = ipc_recv_locked(dstva, npages);
+	spin_unlock(env_lock(curenv));
+	if (m)
+		return ipc_take(m, dstva, npages);
+	// A sender we now accept may be asleep on our full queue, and
+	// nothing is leaving the queue to wake it: wake it to hand its
+	// message over directly.
+	if (nfrom)
+		futex_wake(PADDR(&curenv->env_ipc_queued), NENV);
 	sys_yield();
 	panic("return ?");
 }
 
+// Send 'value' (and the page at 'srcva' with 'perm', as in
+// sys_ipc_try_send) to 'envid', then block until envid replies.  The
+// reply is received as sys_ipc_recv would receive it at 'dstva', in a
+// closed receive from envid: messages from other environments stay
+// queued.  If envid is blocked in sys_ipc_recv, the CPU goes straight
+// to it, without a trip through the scheduler; otherwise the message
+// waits in envid's queue.  envid receives a reply handle for the call
+// in env_ipc_handle, which it can pass to sys_ipc_reply.
+//
+// Returns 0 once the reply has arrived (see sys_ipc_recv), or < 0 on
+// error.  Errors are those of sys_ipc_try_send, and also:
+//	-E_INVAL if envid is the caller itself.
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_BAD_ENV if envid was freed before replying.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     void *dstva)
+{
+	struct Env *e;
+	struct IpcMsg msg;
+	struct PageInfo *page = NULL;
+	int npages = ((uint32_t) srcva < UTOP);
+	int r;
+
+	if (!ipc_check_window(dstva, 1))
+		return -E_INVAL;
+	if ((r = ipc_check_perm(srcva, perm)) < 0)
+		return r;
+	if ((r = envid2env(envid, &e, 0)) < 0)
+		return r;
+	if (e == curenv)
+		return -E_INVAL;
+	envid = e->env_id;
+	if (npages) {
+		if ((r = env_vm_lock_pair(curenv, curenv->env_id, e, envid)) < 0)
+			return r;
+		if ((r = ipc_lookup_page(srcva, perm, &page)) < 0)
+			goto out;
+	}
+	ipc_msg_init(&msg, value, &page, npages, perm);
+	ipc_lock_pair(e);
+	// Handle 0 means "no reply expected".
+	if (++curenv->env_ipc_callno == 0)
+		curenv->env_ipc_callno++;
+	msg.im_handle = curenv->env_ipc_callno;
+	if ((r = ipc_deliver(e, envid, &msg)) >= 0) {
+		// e cannot reply until we let go of our lock, so our
+		// registers are safely in env_tf by then.
+		env_save_tf();
+		curenv->env_ipc_from = 0;
+		curenv->env_ipc_nfrom = 1;
+		curenv->env_ipc_from_set[0] = envid;
+		curenv->env_ipc_callee = envid;
+		curenv->env_ipc_recving = 1;
+		curenv->env_ipc_dstva = dstva;
+		curenv->env_ipc_npages = 1;
+		curenv->env_status = ENV_NOT_RUNNABLE;
+	}
+	ipc_unlock_pair(e);
+out:
+	if (npages)
+		env_vm_unlock_pair(curenv, e);
+	if (r < 0)
+		return r;
+	if (r == 0)
+		env_run(e);
+	sched_yield();
+}
+
+// Reply to the sys_ipc_call that 'envid' made with reply handle
+// 'handle' (see sys_ipc_call), with 'value' and the page at 'srcva'
+// with 'perm', as sys_ipc_try_send would send them.  The caller goes
+// on running; envid is made runnable.  A server can hold several calls
+// at once and answer them in any order this way.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_try_send, and also:
+//	-E_INVAL if envid is the caller itself.
+//	-E_IPC_NOT_RECV if envid is not waiting in sys_ipc_call for a
+//		reply from the caller to the call named by 'handle'.
+static int
+sys_ipc_reply(envid_t envid, uint32_t handle, uint32_t value,
+	      void *srcva, unsigned perm)
+{
+	struct Env *e;
+	struct IpcMsg msg;
+	struct PageInfo *page = NULL;
+	int npages = ((uint32_t) srcva < UTOP);
+	int r;
+
+	if ((r = ipc_check_perm(srcva, perm)) < 0)
+		return r;
+	if ((r = envid2env(envid, &e, 0)) < 0)
+		return r;
+	if (e == curenv)
+		return -E_INVAL;
+	envid = e->env_id;
+	if (npages) {
+		if ((r = env_vm_lock_pair(curenv, curenv->env_id, e, envid)) < 0)
+			return r;
+		if ((r = ipc_lookup_page(srcva, perm, &page)) < 0)
+			goto out;
+	}
+	ipc_msg_init(&msg, value, &page, npages, perm);
+	spin_lock(env_lock(e));
+	if (e->env_id != envid || !handle || e->env_ipc_callno != handle
+	    || e->env_ipc_callee != curenv->env_id
+	    || !ipc_receiving(e, curenv->env_id))
+		r = -E_IPC_NOT_RECV;
+	else if ((r = ipc_deliver(e, envid, &msg)) == 0)
+		sched_enqueue(e);
+	spin_unlock(env_lock(e));
+out:
+	if (npages)
+		env_vm_unlock_pair(curenv, e);
+	return r < 0 ? r : 0;
+}
+
+// Reply to 'envid' with 'value' (and the page at 'srcva' with 'perm'),
+// then wait for the next message as sys_ipc_recv(dstva, 1, 0, 0) does.
+// envid is normally blocked in sys_ipc_call waiting for the caller, and
+// the CPU goes straight back to it, unless a message is already queued
+// for the caller.  If envid is 0, only wait.
+//
+// A reply to an envid that is not waiting for one is queued for it.  A
+// reply that cannot be delivered, because envid has gone away or its
+// queue is full, is dropped: a server should not stop serving because
+// a client misbehaves.
+//
+// Returns 0 once a message has arrived, or < 0 on error.  Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if srcva < UTOP and srcva or perm is inappropriate
+//		(see sys_ipc_try_send).
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva,
+		   unsigned perm, void *dstva)
+{
+	struct Env *to = NULL, *e = NULL;
+	struct IpcMsg msg, *m;
+	struct PageInfo *page = NULL;
+	int npages = ((uint32_t) srcva < UTOP);
+	bool vm_locked = false, replied = false;
+
+	if (!ipc_check_window(dstva, 1))
+		return -E_INVAL;
+	if (ipc_check_perm(srcva, perm) < 0)
+		return -E_INVAL;
+	// e is set only if there is a reply to deliver to it.
+	if (envid && (envid2env(envid, &to, 0) < 0 || to == curenv))
+		to = NULL;
+	if (to && npages) {
+		if (env_vm_lock_pair(curenv, curenv->env_id, to, envid) == 0) {
+			vm_locked = true;
+			if (ipc_lookup_page(srcva, perm, &page) == 0)
+				e = to;
+		}
+	} else
+		e = to;
+
+	if (e) {
+		ipc_msg_init(&msg, value, &page, npages, perm);
+		ipc_lock_pair(e);
+		replied = (ipc_deliver(e, envid, &msg) == 0);
+	} else
+		spin_lock(env_lock(curenv));
+	curenv->env_ipc_nfrom = 0;
+	// Serve a queued message first; envid runs when its turn comes.
+	if ((m = ipc_recv_locked(dstva, 1)) && replied)
+		sched_enqueue(e);
+	if (e)
+		ipc_unlock_pair(e);
+	else
+		spin_unlock(env_lock(curenv));
+	if (vm_locked)
+		env_vm_unlock_pair(curenv, to);
+
+	if (m)
+		return ipc_take(m, dstva, 1);
+	if (replied)
+		env_run(e);
+	sched_yield();
+}
+
+// Make the page at 'va' curenv's system call ring (see inc/ring.h),
+// replacing any earlier ring, or drop curenv's ring if va is NULL.
+// The kernel keeps its own reference to the page, so unmapping it
+// does not pull the ring from under the kernel.  The page must be
+// mapped PTE_SHARE so that fork does not make it copy-on-write and
+// leave curenv writing to a different page than the kernel reads.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_INVAL if va is not mapped writable and PTE_SHARE.
+static int
+sys_ring_setup(void *va)
+{
+	struct PageInfo *pp = NULL;
+	pte_t *pte;
+
+	if (va) {
+		if (check_for_va(va))
+			return -E_INVAL;
+		spin_lock(env_vm_lock(curenv));
+		pp = page_lookup(curenv->env_pgdir, va, &pte);
+		if (pp && (*pte & (PTE_U|PTE_W|PTE_SHARE)) == (PTE_U|PTE_W|PTE_SHARE))
+			page_incref(pp);
+		else
+			pp = NULL;
+		spin_unlock(env_vm_lock(curenv));
+		if (!pp)
+			return -E_INVAL;
+	}
+	if (curenv->env_ring)
+		page_decref(curenv->env_ring);
+	curenv->env_ring = pp;
+	return 0;
+}
+
+// Make one system call from the ring.
+static int32_t
+ring_syscall(const struct RingSqe *sqe)
+{
+	const uint32_t *a = sqe->sqe_args;
+
+	switch (sqe->sqe_num) {
+	case SYS_page_alloc:
+		return sys_page_alloc(a[0], (void*)a[1], a[2]);
+	case SYS_page_map:
+		return sys_page_map(a[0], (void*)a[1], a[2], (void*)a[3], a[4]);
+	case SYS_page_unmap:
+		return sys_page_unmap(a[0], (void*)a[1]);
+	case SYS_ipc_try_send:
+		return sys_ipc_try_send(a[0], a[1], (void*)a[2], a[3]);
+	default:
+		return -E_INVAL;
+	}
+}
+
+// Make up to 'to_submit' of the system calls queued in curenv's ring,
+// in order, posting each one's result in the completion queue.  Stops
+// early when the submission queue is empty or the completion queue is
+// full.
+//
+// Returns the number of system calls made, or -E_INVAL if curenv has
+// no ring.
+static int
+sys_ring_enter(uint32_t to_submit)
+{
+	struct SysRing *ring;
+	struct RingSqe sqe;
+	struct RingCqe *cqe;
+	uint32_t n;
+
+	if (!curenv->env_ring)
+		return -E_INVAL;
+	static_assert(sizeof(struct SysRing) <= PGSIZE);
+	ring = (struct SysRing *) page2kva(curenv->env_ring);
+	for (n = 0; n < to_submit; n++) {
+		if (ring->sr_sq_head == ring->sr_sq_tail
+		    || ring->sr_cq_tail - ring->sr_cq_head >= RING_CQ_SIZE)
+			break;
+		// Copy the entry, which the environment can change under us
+		sqe = ring->sr_sq[ring->sr_sq_head % RING_SQ_SIZE];
+		cqe = &ring->sr_cq[ring->sr_cq_tail % RING_CQ_SIZE];
+		cqe->cqe_res = ring_syscall(&sqe);
+		cqe->cqe_data = sqe.sqe_data;
+		ring->sr_cq_tail++;
+		ring->sr_sq_head++;
+	}
+	return n;
+}
+
+// Wait for environment 'envid' to exit, or for any child of the caller
+// to exit if envid is 0.  Returns the envid that exited; 0 if the
+// caller slept and should try again; -E_BAD_ENV if envid is 0 and the
+// caller has no children left; -E_INVAL if envid is negative.
+static int
+sys_env_wait(envid_t envid)
+{
+	if (envid < 0)
+		return -E_INVAL;
+	return env_wait(envid);
+}
+
+// The physical address of the word at 'va' in pgdir, if the user can
+// read it, else 0.  The words of envs[] qualify as well as those below
+// UTOP, so environments can sleep until another one changes state.
+static physaddr_t
+futex_key(pde_t *pgdir, const void *va)
+{
+	pte_t *pte;
+
+	if ((uintptr_t) va >= ULIM || (uintptr_t) va % sizeof(uint32_t))
+		return 0;
+	if (!(pgdir[PDX(va)] & PTE_U))
+		return 0;
+	pte = pgdir_walk(pgdir, va, 0);
+	if (!pte || (*pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+		return 0;
+	if (*pte & PTE_PS)
+		return (*pte & ~(PTSIZE - 1)) | ((uintptr_t) va & (PTSIZE - 1));
+	return PTE_ADDR(*pte) | PGOFF(va);
+}
+
+// Sleep until another environment calls sys_futex_wake on 'addr',
+// provided the word at 'addr' still holds 'val'.  Environments that map
+// the same page wake each other whatever address they map it at.
+//
+// Returns 0 when woken, which may be spuriously, or at once if *addr
+// != val; the caller should check its condition again either way.
+// Returns -E_INVAL if addr is misaligned or not readable by the caller.
+static int
+sys_futex_wait(uint32_t *addr, uint32_t val)
+{
+	struct WaitQueue *wq;
+	physaddr_t pa;
+
+	// The vm lock keeps the page from being unmapped and reused
+	// before the sleep is queued.
+	spin_lock(env_vm_lock(curenv));
+	if (!(pa = futex_key(curenv->env_pgdir, addr))) {
+		spin_unlock(env_vm_lock(curenv));
+		return -E_INVAL;
+	}
+	wq = futex_queue(pa);
+	spin_lock(&wq->wq_lock);
+	if (*(volatile uint32_t *) KADDR(pa) != val) {
+		spin_unlock(&wq->wq_lock);
+		spin_unlock(env_vm_lock(curenv));
+		return 0;
+	}
+	spin_unlock(env_vm_lock(curenv));
+	waitq_sleep(wq, pa);
+}
+
+// Wake up to 'n' environments sleeping in sys_futex_wait on 'addr'.
+// Returns the number woken, or -E_INVAL if addr is misaligned or not
+// readable by the caller.
+static int
+sys_futex_wake(uint32_t *addr, int n)
+{
+	physaddr_t pa;
+
+	spin_lock(env_vm_lock(curenv));
+	pa = futex_key(curenv->env_pgdir, addr);
+	spin_unlock(env_vm_lock(curenv));
+	if (!pa)
+		return -E_INVAL;
+	return futex_wake(pa, n);
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -401,6 +1346,9 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_cgetc:
 		retval = sys_cgetc();
 		break;
+	case SYS_cgetc_wait:
+		retval = sys_cgetc_wait();
+		break;
 	case SYS_getenvid:
 		retval = sys_getenvid();
 		break;
@@ -431,8 +1379,47 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_ipc_try_send:
 		retval = sys_ipc_try_send(a1, a2, (void*)a3, a4);
 		break;
+	case SYS_ipc_try_sendv:
+		retval = sys_ipc_try_sendv(a1, a2, (const struct IpcSeg *)a3, a4, a5);
+		break;
 	case SYS_ipc_recv:
-		retval = sys_ipc_recv((void*)a1);
+		retval = sys_ipc_recv((void*)a1, a2, (const envid_t *)a3, a4);
+		break;
+	case SYS_fork:
+		retval = sys_fork();
+		break;
+	case SYS_page_mapv:
+		retval = sys_page_mapv(a1, a2, (const struct PageMap *)a3, a4);
+		break;
+	case SYS_page_alloc_range:
+		retval = sys_page_alloc_range(a1, (void*)a2, a3, a4);
+		break;
+	case SYS_page_unmap_range:
+		retval = sys_page_unmap_range(a1, (void*)a2, a3);
+		break;
+	case SYS_ring_setup:
+		retval = sys_ring_setup((void*)a1);
+		break;
+	case SYS_ring_enter:
+		retval = sys_ring_enter(a1);
+		break;
+	case SYS_futex_wait:
+		retval = sys_futex_wait((uint32_t*)a1, a2);
+		break;
+	case SYS_futex_wake:
+		retval = sys_futex_wake((uint32_t*)a1, a2);
+		break;
+	case SYS_env_wait:
+		retval = sys_env_wait(a1);
+		break;
+	case SYS_ipc_call:
+		retval = sys_ipc_call(a1, a2, (void*)a3, a4, (void*)a5);
+		break;
+	case SYS_ipc_reply:
+		retval = sys_ipc_reply(a1, a2, a3, (void*)a4, a5);
+		break;
+	case SYS_ipc_reply_wait:
+		retval = sys_ipc_reply_wait(a1, a2, (void*)a3, a4, (void*)a5);
 		break;
 	case SYS_env_set_trapframe:
 		retval = sys_env_set_trapframe(a1, (void*)a2);
@@ -112,6 +112,7 @@ trap_init(void)
 	}
 	for(int i = 0;i < 16;i++)
 		SETGATE(idt[i + IRQ_OFFSET], 0, GD_KT, funs[idt_id_cnt + i], 0);
+	SETGATE(idt[T_TLBFLUSH], 0, GD_KT, funs[idt_id_cnt + 16], 0);
 	/*SETGATE(idt[0], 0, GD_KT, handler0, 0);
 	SETGATE(idt[1], 0, GD_KT, handler1, 0);
 	SETGATE(idt[3], 1, GD_KT, handler3, 3);
@@ -175,6 +176,17 @@ trap_init_percpu(void)
 	// bottom three bits are special; we leave them 0)
 	ltr(GD_TSS0 + (id << 3));
 
+	// Let user environments make system calls with sysenter, which
+	// enters sysenter_handler on this CPU's kernel stack.  sysexit
+	// takes the user segments from the GDT slots after GD_KT's.
+	if (cpu_has_sysenter()) {
+		static_assert(GD_KD == GD_KT + 8 && GD_UT == GD_KT + 16
+			      && GD_UD == GD_KT + 24);
+		wrmsr(MSR_IA32_SYSENTER_CS, GD_KT);
+		wrmsr(MSR_IA32_SYSENTER_ESP, ts.ts_esp0);
+		wrmsr(MSR_IA32_SYSENTER_EIP, (uint32_t) sysenter_handler);
+	}
+
 	// Load the IDT
 	lidt(&idt_pd);
 }
@@ -271,6 +283,8 @@ trap_dispatch(struct Trapframe *tf)
 		monitor(tf);
 		return;
 	}
+	if (tf->tf_trapno == T_TLBFLUSH)
+		return;		// Already answered in trap()
 
 	// Handle keyboard and serial interrupts.
 	// LAB 5: Your code here.
@@ -320,36 +334,38 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+	// Note that we are no longer halted in sched_halt(), if we were
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
 	assert(!(read_eflags() & FL_IF));
 
+	// Answer TLB shootdowns before anything else, since another CPU
+	// is waiting for us and curenv may be about to go away.
+	if (tf->tf_trapno == T_TLBFLUSH) {
+		lapic_eoi();
+		tlb_shootdown_poll();
+	}
+
 	if ((tf->tf_cs & 3) == 3) {
-		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// LAB 4: Your code here.
-		spin_lock(&kernel_lock);
+		// Trapped from user mode.  There is no big kernel lock:
+		// each kernel subsystem takes the locks it needs.
 		assert(curenv);
 
-		// Garbage collect if current enviroment is a zombie
+		// Garbage collect if current enviroment is a zombie.
+		// Only this CPU moves curenv out of ENV_DYING, so the
+		// unlocked check is safe; env_leave frees it.
 		if (curenv->env_status == ENV_DYING) {
-			env_free(curenv);
-			curenv = NULL;
+			env_leave();
 			sched_yield();
 		}
 
-		// Copy trap frame (which is currently on the stack)
-		// into 'curenv->env_tf', so that running the environment
-		// will restart at the trap point.
-		curenv->env_tf = *tf;
-		// The trapframe on the stack should be ignored from here on.
-		tf = &curenv->env_tf;
+		// Leave the trap frame on the stack: if we go back to
+		// curenv, we go back through it.  It is copied into
+		// 'curenv->env_tf' only if curenv has to be restarted from
+		// there later (see env_save_tf).
+		thiscpu->cpu_tf = tf;
 	}
 
 	// Record that tf is the last real trapframe so
@@ -367,13 +383,46 @@ trap(struct Trapframe *tf)
 
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
-	// if doing so makes sense.
-	if (curenv && curenv->env_status == ENV_RUNNING)
+	// if doing so makes sense.  Usually its registers are still
+	// where they were pushed.
+	if (curenv && curenv->env_status == ENV_RUNNING) {
+		if (tf == thiscpu->cpu_tf) {
+			thiscpu->cpu_tf = NULL;
+			env_pop_tf(tf);
+		}
 		env_run(curenv);
-	else
+	} else
 		sched_yield();
 }
 
+// Called from sysenter_handler for system calls made with sysenter.
+// If the system call returns to the same environment, sysenter_handler
+// goes back to the user with sysexit: none of trap()'s bookkeeping and
+// no env_run.  As in trap(), the trap frame stays on the stack unless
+// curenv has to be restarted from env_tf.
+//
+// sysenter passes only four arguments; a fifth argument is always 0.
+int32_t
+sysenter_trap(struct Trapframe *tf)
+{
+	struct PushRegs *regs = &tf->tf_regs;
+
+	if (curenv->env_status == ENV_DYING) {
+		env_leave();
+		sched_yield();
+	}
+
+	thiscpu->cpu_tf = tf;
+	regs->reg_eax = syscall(regs->reg_eax, regs->reg_edx, regs->reg_ecx,
+				regs->reg_ebx, regs->reg_edi, 0);
+	if (tf == thiscpu->cpu_tf && curenv->env_status == ENV_RUNNING) {
+		thiscpu->cpu_tf = NULL;
+		return regs->reg_eax;
+	}
+	if (curenv->env_status == ENV_RUNNING)
+		env_run(curenv);
+	sched_yield();
+}
 
 void
 page_fault_handler(struct Trapframe *tf)
@@ -421,13 +470,20 @@ page_fault_handler(struct Trapframe *tf)
 	//
 	// Hints:
 	//   user_mem_assert() and env_run() are useful here.
-	//   To change what the user environment runs, modify 'curenv->env_tf'
-	//   (the 'tf' variable points at 'curenv->env_tf').
+	//   To change what the user environment runs, modify 'tf', which
+	//   holds curenv's registers until env_run saves them.
+
+	// Write faults on copy-on-write pages are resolved right here,
+	// without a round trip through the user's handler.
+	if ((tf->tf_err & (FEC_PR|FEC_WR)) == (FEC_PR|FEC_WR)
+	    && page_cow_fault(curenv, fault_va) == 0)
+		env_run(curenv);
 
 	// LAB 4: Your code here.
 	if (curenv->env_pgfault_upcall) 
 	{
 		uint32_t new_esp, len;
+		int r;
 		if (tf->tf_esp >= UXSTACKTOP - PGSIZE && 
 			tf->tf_esp < UXSTACKTOP)
 		{
@@ -442,15 +498,26 @@ page_fault_handler(struct Trapframe *tf)
 		//cprintf("trap_esp: %08x\n", tf->tf_esp);
 		//cprintf("trap_eip: %08x\n", tf->tf_eip);
 		struct UTrapframe *ut = (struct UTrapframe *) new_esp;
-		user_mem_assert(curenv, (void*) new_esp, len, PTE_W);
-		ut->utf_fault_va = fault_va;
-		ut->utf_err = tf->tf_err;
-		ut->utf_regs = tf->tf_regs;
-		ut->utf_eip = tf->tf_eip;
-		ut->utf_eflags = tf->tf_eflags;
-		ut->utf_esp = tf->tf_esp;
-		curenv->env_tf.tf_eip = (uint32_t) curenv->env_pgfault_upcall;
-		curenv->env_tf.tf_esp = new_esp;
+		// Hold the address space lock so that nobody unmaps the
+		// exception stack while we write to it.
+		spin_lock(env_vm_lock(curenv));
+		r = user_mem_check(curenv, (void*) new_esp, len, PTE_U | PTE_W);
+		if (r == 0) {
+			ut->utf_fault_va = fault_va;
+			ut->utf_err = tf->tf_err;
+			ut->utf_regs = tf->tf_regs;
+			ut->utf_eip = tf->tf_eip;
+			ut->utf_eflags = tf->tf_eflags;
+			ut->utf_esp = tf->tf_esp;
+		}
+		spin_unlock(env_vm_lock(curenv));
+		if (r < 0) {
+			user_mem_assert(curenv, (void*) new_esp, len, PTE_W);
+			// The stack was mapped after all: retry the fault.
+			env_run(curenv);
+		}
+		tf->tf_eip = (uint32_t) curenv->env_pgfault_upcall;
+		tf->tf_esp = new_esp;
 		env_run(curenv);
 	}
 	// Destroy the environment that caused the fault.
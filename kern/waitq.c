@@ -0,0 +1,168 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/assert.h>
+#include <inc/mmu.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/waitq.h>
+
+// Futex queues, hashed by physical page so that all the words of one
+// page share a queue and futex_wake_page has only one queue to search.
+#define NFUTEXQ		64
+
+static struct WaitQueue futex_queues[NFUTEXQ];
+
+void
+waitq_init(struct WaitQueue *wq)
+{
+	spin_initlock(&wq->wq_lock);
+	wq->wq_head = NULL;
+}
+
+//
+// Put curenv to sleep on 'wq' until somebody wakes 'key'.
+// The caller holds wq->wq_lock and has checked, with the lock held,
+// that curenv needs to wait.  Releases the lock and runs something
+// else; curenv returns 0 from its system call when it is woken.
+//
+void
+waitq_sleep(struct WaitQueue *wq, uint32_t key)
+{
+	struct Env *e = curenv, **pe;
+
+	// Wakers never touch env_tf, so e's return value can be set
+	// before e is visible on the queue.
+	env_save_tf();
+	e->env_tf.tf_regs.reg_eax = 0;
+	e->env_waitq = wq;
+	e->env_wait_key = key;
+	e->env_wait_next = NULL;
+	for (pe = &wq->wq_head; *pe; pe = &(*pe)->env_wait_next)
+		;
+	*pe = e;
+
+	spin_lock(env_lock(e));
+	if (e->env_status == ENV_RUNNING)
+		e->env_status = ENV_NOT_RUNNABLE;
+	spin_unlock(env_lock(e));
+	spin_unlock(&wq->wq_lock);
+	sched_yield();
+}
+
+// Wake up to 'n' sleepers on 'wq' whose key is in [lo, hi).
+static int
+waitq_wake_keys(struct WaitQueue *wq, uint32_t lo, uint32_t hi, int n)
+{
+	struct Env *e, **pe;
+	int woken = 0;
+
+	pe = &wq->wq_head;
+	while ((e = *pe) && woken < n) {
+		if (e->env_wait_key < lo || e->env_wait_key >= hi) {
+			pe = &e->env_wait_next;
+			continue;
+		}
+		*pe = e->env_wait_next;
+		spin_lock(env_lock(e));
+		if (e->env_status == ENV_NOT_RUNNABLE) {
+			e->env_status = ENV_RUNNABLE;
+			sched_enqueue(e);
+		}
+		spin_unlock(env_lock(e));
+		// Clear env_waitq last: waitq_cancel relies on it to know
+		// when the waker is done with e.
+		e->env_waitq = NULL;
+		woken++;
+	}
+	return woken;
+}
+
+int
+waitq_wake(struct WaitQueue *wq, uint32_t key, int n)
+{
+	return waitq_wake_keys(wq, key, key + 1, n);
+}
+
+int
+waitq_wake_all(struct WaitQueue *wq)
+{
+	return waitq_wake_keys(wq, 0, ~0, NENV);
+}
+
+//
+// Take 'e' off whatever wait queue it sleeps on, without making it
+// runnable.  Used when e is being freed or made runnable by other
+// means.  Must not be called with e's env_lock held.
+//
+void
+waitq_cancel(struct Env *e)
+{
+	struct WaitQueue *wq = e->env_waitq;
+	struct Env **pe;
+
+	if (!wq)
+		return;
+	spin_lock(&wq->wq_lock);
+	if (e->env_waitq == wq) {
+		for (pe = &wq->wq_head; *pe != e; pe = &(*pe)->env_wait_next)
+			assert(*pe);
+		*pe = e->env_wait_next;
+		e->env_waitq = NULL;
+	}
+	spin_unlock(&wq->wq_lock);
+}
+
+void
+futex_init(void)
+{
+	int i;
+
+	for (i = 0; i < NFUTEXQ; i++)
+		waitq_init(&futex_queues[i]);
+}
+
+struct WaitQueue *
+futex_queue(physaddr_t pa)
+{
+	return &futex_queues[PGNUM(pa) % NFUTEXQ];
+}
+
+// Wake up to 'n' environments sleeping on the futex word at 'pa'.
+int
+futex_wake(physaddr_t pa, int n)
+{
+	struct WaitQueue *wq = futex_queue(pa);
+	int woken;
+
+	spin_lock(&wq->wq_lock);
+	woken = waitq_wake(wq, pa, n);
+	spin_unlock(&wq->wq_lock);
+	return woken;
+}
+
+// Wake every environment sleeping on a futex word in the page at 'pa'.
+void
+futex_wake_page(physaddr_t pa)
+{
+	struct WaitQueue *wq = futex_queue(pa);
+
+	pa = ROUNDDOWN(pa, PGSIZE);
+	spin_lock(&wq->wq_lock);
+	waitq_wake_keys(wq, pa, pa + PGSIZE, NENV);
+	spin_unlock(&wq->wq_lock);
+}
+
+// Wake every environment sleeping on any futex.
+void
+futex_wake_all(void)
+{
+	int i;
+
+	for (i = 0; i < NFUTEXQ; i++) {
+		if (!futex_queues[i].wq_head)
+			continue;
+		spin_lock(&futex_queues[i].wq_lock);
+		waitq_wake_all(&futex_queues[i]);
+		spin_unlock(&futex_queues[i].wq_lock);
+	}
+}
@@ -0,0 +1,46 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_WAITQ_H
+#define JOS_KERN_WAITQ_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/spinlock.h>
+
+struct Env;
+
+// A queue of ENV_NOT_RUNNABLE environments waiting for something to
+// happen, linked through env_wait_next.  Each sleeper carries a key
+// saying what it waits for, so unrelated events can share a queue.
+//
+// A sleeper checks its condition with wq_lock held and calls
+// waitq_sleep, which releases the lock; whoever makes the condition
+// true takes wq_lock and calls waitq_wake.  So a wakeup cannot slip in
+// between the check and the sleep.  A woken environment returns 0
+// from the system call that put it to sleep and must check its
+// condition again: wakeups can be spurious.
+struct WaitQueue {
+	struct spinlock wq_lock;
+	struct Env *wq_head;		// Oldest sleeper first
+};
+
+void	waitq_init(struct WaitQueue *wq);
+// Called with wq->wq_lock held; does not return.
+void	waitq_sleep(struct WaitQueue *wq, uint32_t key) __attribute__((noreturn));
+// Called with wq->wq_lock held; return how many envs were woken.
+int	waitq_wake(struct WaitQueue *wq, uint32_t key, int n);
+int	waitq_wake_all(struct WaitQueue *wq);
+void	waitq_cancel(struct Env *e);
+
+// Futexes: wait queues for words of user memory, keyed by the words'
+// physical addresses so that every environment mapping a shared page
+// agrees on the key.
+void	futex_init(void);
+struct WaitQueue *futex_queue(physaddr_t pa);
+int	futex_wake(physaddr_t pa, int n);
+void	futex_wake_page(physaddr_t pa);
+void	futex_wake_all(void);
+
+#endif	// !JOS_KERN_WAITQ_H
@@ -9,6 +9,10 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
+// The server keeps fsipcbuf mapped as our request channel after the
+// first request, so later requests send only the request code.  A new
+// environment, or a fork that left us a copy of the page, sends the
+// page again.
 // type: request code, passed as the simple integer IPC value.
 // dstva: virtual address at which to receive reply page, 0 if none.
 // Returns result from the file server.
@@ -16,16 +20,29 @@ static int
 fsipc(unsigned type, void *dstva)
 {
 	static envid_t fsenv;
+	static envid_t chan_env;
+	static physaddr_t chan_pa;
+	volatile uint32_t *word = (volatile uint32_t *) &fsipcbuf;
+	void *pg = NULL;
+
 	if (fsenv == 0)
 		fsenv = ipc_find_env(ENV_TYPE_FS);
 
 	static_assert(sizeof(fsipcbuf) == PGSIZE);
 
+	// Break any copy-on-write sharing of fsipcbuf first.
+	*word = *word;
+	if (chan_env != thisenv->env_id
+	    || chan_pa != PTE_ADDR(uvpt[PGNUM(&fsipcbuf)])) {
+		chan_env = thisenv->env_id;
+		chan_pa = PTE_ADDR(uvpt[PGNUM(&fsipcbuf)]);
+		pg = &fsipcbuf;
+	}
+
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return ipc_call(fsenv, type, pg, PTE_P | PTE_W | PTE_U, dstva, NULL);
 }
 
 static int devfile_flush(struct Fd *fd);
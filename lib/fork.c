@@ -3,14 +3,14 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
 //
+// The kernel normally resolves copy-on-write faults without calling
+// us (see page_cow_fault); we only see the ones it could not, e.g.
+// when it ran out of memory.
+//
 static void
 pgfault(struct UTrapframe *utf)
 {
@@ -48,90 +48,22 @@ pgfault(struct UTrapframe *utf)
 }
 
 //
-// Map our virtual page pn (address pn*PGSIZE) into the target envid
-// at the same virtual address.  If the page is writable or copy-on-write,
-// the new mapping must be created copy-on-write, and then our mapping must be
-// marked copy-on-write as well.  (Exercise: Why do we need to mark ours
-// copy-on-write again if it was already copy-on-write at the beginning of
-// this function?)
-//
-// Returns: 0 on success, < 0 on error.
-// It is also OK to panic on error.
-//
-static int
-duppage(envid_t envid, unsigned pn)
-{
-	int r;
-
-	// LAB 4: Your code here.
-	uint32_t addr = pn * PGSIZE;
-	int error_code = 0;
-	//cprintf("%08x\n", addr);
-	if (uvpt[pn] & PTE_SHARE)
-	{
-		if ((error_code = sys_page_map(0, (void*) addr, envid, (void*) addr, uvpt[pn] & PTE_SYSCALL)) < 0)
-			panic("duppage: shared page, 0 -> envid %e!", error_code);
-	}
-	else
-	{
-		if (uvpt[pn] & (PTE_W | PTE_COW))
-		{
-			if ((error_code = sys_page_map(0, (void*) addr, envid, (void*) addr, PTE_COW | PTE_U | PTE_P)) < 0)
-				panic("duppage: COW, 0 -> envid %e!", error_code);
-			if ((error_code = sys_page_map(0, (void*) addr, 0, (void*) addr, PTE_COW | PTE_U | PTE_P)) < 0)
-				panic("duppage: COW, 0 -> 0 %e!", error_code);
-			//cprintf("enen\n");
-		}
-		else
-		{
-			if ((error_code = sys_page_map(0, (void*) addr, envid, (void*) addr, PTE_U | PTE_P)) < 0)
-				panic("duppage: read-only, 0 -> envid %e!", error_code);
-		}
-	}
-	return 0;
-}
-
-//
-// User-level fork with copy-on-write.
-// Set up our page fault handler appropriately.
-// Create a child.
-// Copy our address space and page fault handler setup to the child.
-// Then mark the child as runnable and return.
+// Fork with copy-on-write.
+// Set up our page fault handler appropriately, then let the kernel
+// create the child: sys_fork copies our address space copy-on-write
+// (sharing PTE_SHARE pages), gives the child a fresh user exception
+// stack and our page fault handler, and marks it runnable.
 //
 // Returns: child's envid to the parent, 0 to the child, < 0 on error.
-// It is also OK to panic on error.
-//
-// Hint:
-//   Use uvpd, uvpt, and duppage.
-//   Remember to fix "thisenv" in the child process.
-//   Neither user exception stack should ever be marked copy-on-write,
-//   so you must allocate a new page for the child's user exception stack.
 //
 envid_t
 fork(void)
 {
-	// LAB 4: Your code here.
+	envid_t envid;
+
 	set_pgfault_handler(pgfault);
-	envid_t envid = sys_exofork();
-	if (envid < 0)
-		panic("fork: sys_exofork error!");
-	else if (envid == 0)
-	{
+	if ((envid = sys_fork()) == 0)
 		thisenv = envs + ENVX(sys_getenvid());
-		return 0;
-	}
-	for(uint32_t i = 0;i < USTACKTOP;i += PGSIZE)
-	{
-		if ((uvpd[PDX(i)] & PTE_P) && (uvpt[PGNUM(i)] & PTE_P) && (uvpt[PGNUM(i)] & PTE_U))
-			duppage(envid, PGNUM(i));
-	}
-	//panic("here");
-	if (sys_page_alloc(envid, (void*) (UXSTACKTOP - PGSIZE), PTE_W | PTE_U | PTE_P) < 0)
-		panic("fork: sys_page_map on UXSTACKTOP");
-	if (sys_env_set_pgfault_upcall(envid, thisenv->env_pgfault_upcall) < 0)
-		panic("fork: sys_env_set_pgfault_upcall");
-	if (sys_env_set_status(envid, ENV_RUNNABLE) < 0)
-		panic("fork: sys_env_set_status");
 	return envid;
 }
 
@@ -43,8 +43,11 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 // This function keeps trying until it succeeds.
 // It should panic() on any error other than -E_IPC_NOT_RECV.
 //
+// If 'toenv' is not receiving, the kernel queues the message.  While
+// its queue is full, sleep on the queue's depth, which drops as 'toenv'
+// receives.
+//
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
 //   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
@@ -60,10 +63,127 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 		//cprintf("hanging here?\n");
 		if (error_code != -E_IPC_NOT_RECV)
 			panic("ipc_send: %e", error_code);
-		sys_yield();
+		sys_futex_wait(&envs[ENVX(to_env)].env_ipc_queued, ENV_IPCQ_MAX);
+	}
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv' and
+// wait for its reply, as ipc_send followed by ipc_recv would, but in one
+// system call that runs 'toenv' right away.  'rcv_pg' and 'perm_store'
+// are as for ipc_recv.  Returns the reply's value, or < 0 if 'toenv'
+// exited before replying.  Panics on any other error.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	if (pg == NULL) pg = (void*) -1;
+	if (rcv_pg == NULL) rcv_pg = (void*) -1;
+	if (perm_store) *perm_store = 0;
+	while ((r = sys_ipc_call(to_env, val, pg, perm, rcv_pg)) != 0) {
+		if (r == -E_BAD_ENV)
+			return r;
+		if (r != -E_IPC_NOT_RECV)
+			panic("ipc_call: %e", r);
+		sys_futex_wait(&envs[ENVX(to_env)].env_ipc_queued, ENV_IPCQ_MAX);
+	}
+	if (perm_store) *perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// Reply to 'toenv' with 'val' (and 'pg' with 'perm', if 'pg' is nonnull),
+// then receive the next message as ipc_recv does.  If 'toenv' is 0, only
+// receive.  This is a server's main loop step: the reply goes straight
+// back to a client blocked in ipc_call.
+int32_t
+ipc_reply_wait(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	if (pg == NULL) pg = (void*) -1;
+	if (rcv_pg == NULL) rcv_pg = (void*) -1;
+	if (from_env_store) *from_env_store = 0;
+	if (perm_store) *perm_store = 0;
+	if ((r = sys_ipc_reply_wait(to_env, val, pg, perm, rcv_pg)) < 0)
+		return r;
+	if (from_env_store) *from_env_store = thisenv->env_ipc_from;
+	if (perm_store) *perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// Receive a message as ipc_recv does, but only from one of the 'nfrom'
+// environments in 'from'; messages from anyone else stay queued for a
+// later receive.  Returns < 0 if none of them exists or the last of
+// them exits while we wait.
+int32_t
+ipc_recv_from(const envid_t *from, int nfrom, envid_t *from_env_store,
+	      void *pg, int *perm_store)
+{
+	int r;
+
+	if (pg == NULL) pg = (void*) -1;
+	if (from_env_store) *from_env_store = 0;
+	if (perm_store) *perm_store = 0;
+	if ((r = sys_ipc_recv_from(pg, 1, from, nfrom)) < 0)
+		return r;
+	if (from_env_store) *from_env_store = thisenv->env_ipc_from;
+	if (perm_store) *perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// Reply with 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to the
+// ipc_call 'toenv' made, which arrived with thisenv->env_ipc_handle
+// equal to 'handle', without waiting for the next message.  A server
+// can keep several calls outstanding and answer them in any order.
+// Returns 0, or < 0 if 'toenv' is no longer waiting for that reply.
+int
+ipc_reply(envid_t to_env, uint32_t handle, uint32_t val, void *pg, int perm)
+{
+	if (pg == NULL) pg = (void*) -1;
+	return sys_ipc_reply(to_env, handle, val, pg, perm);
+}
+
+// Send 'val' and every page of the 'nsegs' ranges in 'segs' to 'toenv',
+// with permission 'perm', in one message.  The pages arrive at
+// consecutive addresses in the window the receiver gave ipc_recvv.
+// Like ipc_send, this keeps trying until it succeeds, and panics on any
+// error other than -E_IPC_NOT_RECV.
+void
+ipc_sendv(envid_t to_env, uint32_t val, const struct IpcSeg *segs,
+	  int nsegs, int perm)
+{
+	int r;
+
+	while ((r = sys_ipc_try_sendv(to_env, val, segs, nsegs, perm)) != 0) {
+		if (r != -E_IPC_NOT_RECV)
+			panic("ipc_sendv: %e", r);
+		sys_futex_wait(&envs[ENVX(to_env)].env_ipc_queued, ENV_IPCQ_MAX);
 	}
 }
 
+// Receive a message as ipc_recv does, but accept up to 'npages' pages,
+// mapped from 'pg' on.  If 'npages_store' is nonnull, store the number
+// of pages received in *npages_store.
+int32_t
+ipc_recvv(envid_t *from_env_store, void *pg, int npages, int *perm_store,
+	  int *npages_store)
+{
+	int r;
+
+	if (pg == NULL) pg = (void*) -1;
+	if (from_env_store) *from_env_store = 0;
+	if (perm_store) *perm_store = 0;
+	if (npages_store) *npages_store = 0;
+	if ((r = sys_ipc_recvv(pg, npages)) < 0)
+		return r;
+	if (from_env_store) *from_env_store = thisenv->env_ipc_from;
+	if (perm_store) *perm_store = thisenv->env_ipc_perm;
+	if (npages_store) *npages_store = thisenv->env_ipc_npages;
+	return thisenv->env_ipc_value;
+}
+
 // Find the first environment of the given type.  We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
@@ -22,6 +22,10 @@ struct Dev devpipe =
 struct Pipe {
 	off_t p_rpos;		// read position
 	off_t p_wpos;		// write position
+	uint32_t p_seq;		// bumped whenever either end wakes the other
+	uint32_t p_sleepers;	// envs asleep on p_seq
+	bool p_rclosed;		// every reader is gone
+	bool p_wclosed;		// every writer is gone
 	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
 };
 
@@ -101,11 +105,45 @@ pipeisclosed(int fdnum)
 	return _pipeisclosed(fd, p);
 }
 
+// Read p's wakeup sequence number.  Read it before checking whether to
+// sleep, and pass it to pipe_sleep: a peer that moves p_rpos or p_wpos,
+// or closes its end, after the check changes it and wakes us.
+static uint32_t
+pipe_seq(struct Pipe *p)
+{
+	uint32_t seq = p->p_seq;
+
+	__sync_synchronize();
+	return seq;
+}
+
+// Sleep until p's sequence number is no longer 'seq'.
+static void
+pipe_sleep(struct Pipe *p, uint32_t seq)
+{
+	// Count ourselves before the kernel looks at p_seq, so that a
+	// peer that bumps p_seq afterwards sees p_sleepers and wakes us.
+	__sync_fetch_and_add(&p->p_sleepers, 1);
+	sys_futex_wait(&p->p_seq, seq);
+	__sync_fetch_and_sub(&p->p_sleepers, 1);
+}
+
+// Wake the other end, after moving p_rpos or p_wpos or closing.
+static void
+pipe_wakeup(struct Pipe *p)
+{
+	// The locked add orders our stores before the read of p_sleepers.
+	__sync_fetch_and_add(&p->p_seq, 1);
+	if (p->p_sleepers)
+		sys_futex_wake(&p->p_seq, NENV);
+}
+
 static ssize_t
 devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
 	uint8_t *buf;
 	size_t i;
+	uint32_t seq;
 	struct Pipe *p;
 
 	p = (struct Pipe*)fd2data(fd);
@@ -118,21 +156,27 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 		while (p->p_rpos == p->p_wpos) {
 			// pipe is empty
 			// if we got any data, return it
-			if (i > 0)
+			if (i > 0) {
+				pipe_wakeup(p);
 				return i;
+			}
+			seq = pipe_seq(p);
+			if (p->p_rpos != p->p_wpos)
+				break;
 			// if all the writers are gone, note eof
-			if (_pipeisclosed(fd, p))
+			if (p->p_wclosed || _pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// sleep until a writer comes along
 			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+				cprintf("devpipe_read sleep\n");
+			pipe_sleep(p, seq);
 		}
 		// there's a byte.  take it.
 		// wait to increment rpos until the byte is taken!
 		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
 		p->p_rpos++;
 	}
+	pipe_wakeup(p);
 	return i;
 }
 
@@ -141,6 +185,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 {
 	const uint8_t *buf;
 	size_t i;
+	uint32_t seq;
 	struct Pipe *p;
 
 	p = (struct Pipe*) fd2data(fd);
@@ -152,15 +197,20 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 	for (i = 0; i < n; i++) {
 		while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf)) {
 			// pipe is full
+			// let the readers at what we wrote
+			pipe_wakeup(p);
+			seq = pipe_seq(p);
+			if (p->p_wpos < p->p_rpos + sizeof(p->p_buf))
+				break;
 			// if all the readers are gone
 			// (it's only writers like us now),
 			// note eof
-			if (_pipeisclosed(fd, p))
+			if (p->p_rclosed || _pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// sleep until they make room
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write sleep\n");
+			pipe_sleep(p, seq);
 		}
 		// there's room for a byte.  store it.
 		// wait to increment wpos until the byte is stored!
@@ -168,6 +218,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 		p->p_wpos++;
 	}
 
+	pipe_wakeup(p);
 	return i;
 }
 
@@ -185,7 +236,22 @@ devpipe_stat(struct Fd *fd, struct Stat *stat)
 static int
 devpipe_close(struct Fd *fd)
 {
+	struct Pipe *p = (struct Pipe*) fd2data(fd);
+	const volatile struct PageInfo *pp = &pages[PGNUM(uvpt[PGNUM(fd)])];
+	bool reader = ((fd->fd_omode & O_ACCMODE) == O_RDONLY);
+
 	(void) sys_page_unmap(0, fd);
-	return sys_page_unmap(0, fd2data(fd));
+	// If that was the last reference to our end's Fd page, the other
+	// end can never see us again.  _pipeisclosed only notices once p
+	// is unmapped too, so say so in p, while we still can, and bump
+	// p_seq so that a peer about to sleep does not miss it.
+	if (pp->pp_ref == 0) {
+		if (reader)
+			p->p_rclosed = 1;
+		else
+			p->p_wclosed = 1;
+		pipe_wakeup(p);
+	}
+	return sys_page_unmap(0, p);
 }
 
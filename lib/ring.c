@@ -0,0 +1,78 @@
+// Library side of the system call ring (see inc/ring.h).
+
+#include <inc/lib.h>
+#include <inc/ring.h>
+
+// Where every environment maps its ring
+#define RING	((struct SysRing *) 0xE0000000)
+
+// env_id of the environment that set up the ring at RING.  The children
+// of fork inherit the ring page, since it is PTE_SHARE, but not the
+// kernel's registration of it, so they set up rings of their own.
+static envid_t ring_owner;
+
+static int
+ring_init(void)
+{
+	int r;
+
+	if (ring_owner == thisenv->env_id)
+		return 0;
+	if ((r = sys_page_alloc(0, RING, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0
+	    || (r = sys_ring_setup(RING)) < 0)
+		return r;
+	ring_owner = thisenv->env_id;
+	return 0;
+}
+
+// Queue system call 'num' with the given arguments, to be made by the
+// next ring_flush.  Only the system calls listed in inc/ring.h may be
+// queued.  If the ring is full, flushes it first.
+//
+// Returns 0 on success, < 0 if the ring could not be set up or if
+// flushing it returned an error, in which case 'num' is not queued.
+int
+ring_queue(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	struct RingSqe *sqe;
+	int r;
+
+	if ((r = ring_init()) < 0)
+		return r;
+	if (RING->sr_sq_tail - RING->sr_sq_head == RING_SQ_SIZE
+	    && (r = ring_flush()) < 0)
+		return r;
+	sqe = &RING->sr_sq[RING->sr_sq_tail % RING_SQ_SIZE];
+	sqe->sqe_num = num;
+	sqe->sqe_args[0] = a1;
+	sqe->sqe_args[1] = a2;
+	sqe->sqe_args[2] = a3;
+	sqe->sqe_args[3] = a4;
+	sqe->sqe_args[4] = a5;
+	sqe->sqe_data = num;
+	RING->sr_sq_tail++;
+	return 0;
+}
+
+// Have the kernel make all the queued system calls, and reap their
+// completions.  Returns 0 if they all succeeded, otherwise the first
+// error.
+int
+ring_flush(void)
+{
+	struct RingCqe *cqe;
+	int r, err = 0;
+
+	if ((r = ring_init()) < 0)
+		return r;
+	while (RING->sr_sq_head != RING->sr_sq_tail) {
+		if ((r = sys_ring_enter(RING->sr_sq_tail - RING->sr_sq_head)) < 0)
+			return r;
+		for (; RING->sr_cq_head != RING->sr_cq_tail; RING->sr_cq_head++) {
+			cqe = &RING->sr_cq[RING->sr_cq_head % RING_CQ_SIZE];
+			if (cqe->cqe_res < 0 && err == 0)
+				err = cqe->cqe_res;
+		}
+	}
+	return err;
+}
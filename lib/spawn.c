@@ -265,8 +265,8 @@ static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
 	int fd, size_t filesz, off_t fileoffset, int perm)
 {
-	int i, r;
-	void *blk;
+	struct PageMap v[PAGEV_MAX];
+	int i, j, n, r;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -277,39 +277,78 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
+	for (i = 0; i < memsz; i += n * PGSIZE) {
 		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
+			// allocate the blank pages
+			n = (ROUNDUP(memsz, PGSIZE) - i) / PGSIZE;
+			if ((r = sys_page_alloc_range(child, (void*) (va + i), n, perm)) < n)
+				return r < 0 ? r : -E_NO_MEM;
 		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
+			// from file, up to PAGEV_MAX pages at a time
+			n = MIN((ROUNDUP(filesz, PGSIZE) - i) / PGSIZE, PAGEV_MAX);
+			if ((r = sys_page_alloc_range(0, UTEMP, n, PTE_P|PTE_U|PTE_W)) < n)
+				return r < 0 ? r : -E_NO_MEM;
 			if ((r = seek(fd, fileoffset + i)) < 0)
 				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
+			if ((r = readn(fd, UTEMP, MIN(n * PGSIZE, filesz-i))) < 0)
 				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
+			for (j = 0; j < n; j++) {
+				v[j].pm_srcva = UTEMP + j * PGSIZE;
+				v[j].pm_dstva = (void*) (va + i + j * PGSIZE);
+				v[j].pm_perm = perm;
+			}
+			if ((r = sys_page_mapv(0, child, v, n)) < n) {
+				// v[r] failed; map it alone for the error
+				if (r >= 0)
+					r = sys_page_mapv(0, child, v + r, 1);
+				panic("spawn: sys_page_mapv data: %e", r);
+			}
+			sys_page_unmap_range(0, UTEMP, n);
 		}
 	}
 	return 0;
 }
 
+// Map the 'n' shared pages described by 'v' into envid.
+static void
+map_shared_pages(envid_t envid, const struct PageMap *v, int n)
+{
+	int r;
+
+	if (n && (r = sys_page_mapv(0, envid, v, n)) < n) {
+		// v[r] failed; map it alone for the error
+		if (r >= 0)
+			r = sys_page_mapv(0, envid, v + r, 1);
+		panic("copy_shared_pages: shared page, 0 -> envid %e!", r);
+	}
+}
+
 // Copy the mappings for shared pages into the child address space.
 static int
 copy_shared_pages(envid_t envid)
 {
 	// LAB 5: Your code here.
-	int error_code;
+	struct PageMap v[PAGEV_MAX];
+	int n = 0;
 	for(uint32_t i = 0;i < USTACKTOP;i += PGSIZE)
 	{
-		if ((uvpd[PDX(i)] & PTE_P) && (uvpt[PGNUM(i)] & PTE_P) && (uvpt[PGNUM(i)] & PTE_SHARE))
-			if ((error_code = sys_page_map(0, (void*) i, envid, (void*) i, uvpt[PGNUM(i)] & PTE_SYSCALL)) < 0)
-				panic("copy_shared_pages: shared page, 0 -> envid %e!", error_code);
+		if (!(uvpd[PDX(i)] & PTE_P))
+		{
+			i += PTSIZE - PGSIZE;
+			continue;
+		}
+		if ((uvpt[PGNUM(i)] & PTE_P) && (uvpt[PGNUM(i)] & PTE_SHARE))
+		{
+			v[n].pm_srcva = v[n].pm_dstva = (void*) i;
+			v[n].pm_perm = uvpt[PGNUM(i)] & PTE_SYSCALL;
+			if (++n == PAGEV_MAX)
+			{
+				map_shared_pages(envid, v, n);
+				n = 0;
+			}
+		}
 	}
+	map_shared_pages(envid, v, n);
 	if (sys_page_alloc(envid, (void*) (UXSTACKTOP - PGSIZE), PTE_W | PTE_U | PTE_P) < 0)
 		panic("copy_shared_pages: sys_page_map on UXSTACKTOP");
 	if (sys_env_set_pgfault_upcall(envid, thisenv->env_pgfault_upcall) < 0)
@@ -2,12 +2,39 @@
 
 #include <inc/syscall.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
+
+// 1 if the kernel takes system calls through sysenter, 0 if not, -1 if
+// we have not looked yet.  The kernel sets sysenter up on every CPU
+// that has it.
+static int use_sysenter = -1;
 
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
 	int32_t ret;
 
+	if (use_sysenter < 0)
+		use_sysenter = cpu_has_sysenter();
+
+	// Fast system call: sysenter takes the same registers, except
+	// that SI holds the return address and BP the stack pointer,
+	// which leaves no room for a fifth parameter.  The kernel
+	// passes 0 for it, so any call whose fifth parameter is 0 can
+	// use sysenter.  sysenter does not clear the trap flag, so
+	// while we single-step (FL_TF) we trap instead.
+	if (use_sysenter && a5 == 0 && !(read_eflags() & FL_TF)) {
+		asm volatile("pushl %%ebp\n\t"
+			     "movl %%esp, %%ebp\n\t"
+			     "leal 1f, %%esi\n\t"
+			     "sysenter\n"
+			     "1:\tpopl %%ebp"
+			     : "=a" (ret), "+d" (a1), "+c" (a2)
+			     : "0" (num), "b" (a3), "D" (a4)
+			     : "esi", "cc", "memory");
+		goto out;
+	}
+
 	// Generic system call: pass system call number in AX,
 	// up to five parameters in DX, CX, BX, DI, SI.
 	// Interrupt kernel with T_SYSCALL.
@@ -31,6 +58,7 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		       "S" (a5)
 		     : "cc", "memory");
 
+out:
 	if(check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
 
@@ -49,6 +77,12 @@ sys_cgetc(void)
 	return syscall(SYS_cgetc, 0, 0, 0, 0, 0, 0);
 }
 
+int
+sys_cgetc_wait(void)
+{
+	return syscall(SYS_cgetc_wait, 0, 0, 0, 0, 0, 0);
+}
+
 int
 sys_env_destroy(envid_t envid)
 {
@@ -111,9 +145,99 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
 }
 
+int
+sys_ipc_try_sendv(envid_t envid, uint32_t value, const struct IpcSeg *segs,
+		  int nsegs, int perm)
+{
+	return syscall(SYS_ipc_try_sendv, 0, envid, value, (uint32_t) segs, nsegs, perm);
+}
+
 int
 sys_ipc_recv(void *dstva)
 {
-	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 1, 0, 0, 0);
+}
+
+int
+sys_ipc_recvv(void *dstva, int npages)
+{
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, npages, 0, 0, 0);
 }
 
+int
+sys_ipc_recv_from(void *dstva, int npages, const envid_t *from, int nfrom)
+{
+	return syscall(SYS_ipc_recv, 0, (uint32_t)dstva, npages, (uint32_t) from, nfrom, 0);
+}
+
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_page_mapv(envid_t srcenv, envid_t dstenv, const struct PageMap *v, int n)
+{
+	return syscall(SYS_page_mapv, 0, srcenv, dstenv, (uint32_t) v, n, 0);
+}
+
+int
+sys_page_alloc_range(envid_t env, void *va, int npages, int perm)
+{
+	return syscall(SYS_page_alloc_range, 0, env, (uint32_t) va, npages, perm, 0);
+}
+
+int
+sys_page_unmap_range(envid_t env, void *va, int npages)
+{
+	return syscall(SYS_page_unmap_range, 0, env, (uint32_t) va, npages, 0, 0);
+}
+
+int
+sys_ring_setup(void *va)
+{
+	return syscall(SYS_ring_setup, 1, (uint32_t) va, 0, 0, 0, 0);
+}
+
+int
+sys_ring_enter(uint32_t to_submit)
+{
+	return syscall(SYS_ring_enter, 0, to_submit, 0, 0, 0, 0);
+}
+
+int
+sys_futex_wait(const volatile uint32_t *addr, uint32_t val)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, val, 0, 0, 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, int n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
+
+int
+sys_env_wait(envid_t envid)
+{
+	return syscall(SYS_env_wait, 0, envid, 0, 0, 0, 0);
+}
+
+int
+sys_ipc_call(envid_t to_env, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, to_env, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply(envid_t to_env, uint32_t handle, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_reply, 0, to_env, handle, value, (uint32_t) srcva, perm);
+}
+
+int
+sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_reply_wait, 0, to_env, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
@@ -4,10 +4,19 @@
 void
 wait(envid_t envid)
 {
-	const volatile struct Env *e;
-
 	assert(envid != 0);
-	e = &envs[ENVX(envid)];
-	while (e->env_id == envid && e->env_status != ENV_FREE)
-		sys_yield();
+	while (sys_env_wait(envid) == 0)
+		;
+}
+
+// Waits until any child of ours exits, and returns its envid.
+// Returns -E_BAD_ENV if we have no children left to wait for.
+envid_t
+wait_any(void)
+{
+	envid_t r;
+
+	while ((r = sys_env_wait(0)) == 0)
+		;
+	return r;
 }
@@ -0,0 +1,39 @@
+// Fill our IPC queue with messages from one child, so that a second
+// child's send sleeps on the full queue, then receive from the second
+// child alone.  The closed receive must wake it to deliver directly.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	envid_t filler, sender, who;
+	int i;
+	int32_t v;
+
+	if ((filler = fork()) == 0) {
+		for (i = 0; i < ENV_IPCQ_MAX; i++)
+			ipc_send(thisenv->env_parent_id, i, 0, 0);
+		return;
+	}
+	while (thisenv->env_ipc_queued < ENV_IPCQ_MAX)
+		sys_yield();
+
+	if ((sender = fork()) == 0) {
+		ipc_send(thisenv->env_parent_id, 0x1234, 0, 0);
+		return;
+	}
+	// Wait for the sender to fall asleep on our full queue.
+	while (envs[ENVX(sender)].env_status != ENV_NOT_RUNNABLE)
+		sys_yield();
+
+	if ((v = ipc_recv_from(&sender, 1, &who, 0, 0)) != 0x1234
+	    || who != sender)
+		panic("closed receive got %d from %08x", v, who);
+	for (i = 0; i < ENV_IPCQ_MAX; i++)
+		if ((v = ipc_recv(&who, 0, 0)) != i || who != filler)
+			panic("queued message %d is %d from %08x", i, v, who);
+	cprintf("closed receive is good\n");
+	wait(filler);
+	wait(sender);
+}
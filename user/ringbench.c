@@ -0,0 +1,54 @@
+// System call ring benchmark.
+//
+// Maps one page at NPAGES consecutive addresses and unmaps it again,
+// first with one sys_page_map and one sys_page_unmap per page, then by
+// queueing the same system calls in the system call ring, which makes
+// up to RING_SQ_SIZE of them per kernel entry.
+
+#include <inc/lib.h>
+#include <inc/ring.h>
+#include <inc/x86.h>
+
+#define NPAGES	1000
+#define SRCVA	((char *) 0x10000000)
+#define DSTVA	((char *) 0x20000000)
+#define PERM	(PTE_P|PTE_U|PTE_W)
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start, direct, ring;
+	int i, r;
+
+	if ((r = sys_page_alloc(0, SRCVA, PERM)) < 0)
+		panic("sys_page_alloc: %e", r);
+	// Set the ring up outside the timed loop
+	if ((r = ring_flush()) < 0)
+		panic("ring_flush: %e", r);
+
+	start = read_tsc();
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_map(0, SRCVA, 0, DSTVA + i * PGSIZE, PERM)) < 0)
+			panic("sys_page_map: %e", r);
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_unmap(0, DSTVA + i * PGSIZE)) < 0)
+			panic("sys_page_unmap: %e", r);
+	direct = read_tsc() - start;
+
+	start = read_tsc();
+	for (i = 0; i < NPAGES; i++)
+		if ((r = ring_queue(SYS_page_map, 0, (uint32_t) SRCVA, 0,
+				    (uint32_t) (DSTVA + i * PGSIZE), PERM)) < 0)
+			panic("ring_queue: %e", r);
+	for (i = 0; i < NPAGES; i++)
+		if ((r = ring_queue(SYS_page_unmap, 0,
+				    (uint32_t) (DSTVA + i * PGSIZE), 0, 0, 0)) < 0)
+			panic("ring_queue: %e", r);
+	if ((r = ring_flush()) < 0)
+		panic("ring_flush: %e", r);
+	ring = read_tsc() - start;
+
+	cprintf("ringbench: %d maps and unmaps: direct %llu cycles/call, "
+		"ring %llu cycles/call\n", NPAGES,
+		direct / (2 * NPAGES), ring / (2 * NPAGES));
+}
@@ -0,0 +1,73 @@
+// Multi-CPU system call throughput benchmark.
+//
+// Forks NWORKERS children that each hammer the page mapping system
+// calls on their own address space, then reports aggregate throughput.
+// Run it with different CPU counts, e.g.
+//	make run-scalebench-nox CPUS=1
+//	make run-scalebench-nox CPUS=4
+// and compare the ops/Mcycle figures: with fine-grained kernel locking,
+// workers on different CPUs do not serialize on each other.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NWORKERS	4
+#define ITERS		2000
+#define OPS_PER_ITER	4
+
+#define VA1		((void *) 0x10000000)
+#define VA2		((void *) 0x10001000)
+
+static void
+worker(void)
+{
+	uint64_t start;
+	int i, r;
+
+	// Wait for the go signal so that all workers start together.
+	ipc_recv(NULL, 0, 0);
+
+	start = read_tsc();
+	for (i = 0; i < ITERS; i++) {
+		if ((r = sys_page_alloc(0, VA1, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		if ((r = sys_page_map(0, VA1, 0, VA2, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_map: %e", r);
+		if ((r = sys_page_unmap(0, VA2)) < 0)
+			panic("sys_page_unmap: %e", r);
+		if ((r = sys_page_unmap(0, VA1)) < 0)
+			panic("sys_page_unmap: %e", r);
+	}
+	cprintf("worker %08x on CPU %d: %llu cycles/op\n",
+		thisenv->env_id, thisenv->env_cpunum,
+		(read_tsc() - start) / (ITERS * OPS_PER_ITER));
+	ipc_send(thisenv->env_parent_id, 0, 0, 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who[NWORKERS];
+	uint64_t start, cycles;
+	int i;
+
+	for (i = 0; i < NWORKERS; i++) {
+		if ((who[i] = fork()) < 0)
+			panic("fork: %e", who[i]);
+		if (who[i] == 0) {
+			worker();
+			return;
+		}
+	}
+
+	start = read_tsc();
+	for (i = 0; i < NWORKERS; i++)
+		ipc_send(who[i], 0, 0, 0);
+	for (i = 0; i < NWORKERS; i++)
+		ipc_recv(NULL, 0, 0);
+	cycles = read_tsc() - start;
+
+	cprintf("scalebench: %d workers, %d ops in %llu cycles: %llu ops/Mcycle\n",
+		NWORKERS, NWORKERS * ITERS * OPS_PER_ITER, cycles,
+		(uint64_t) NWORKERS * ITERS * OPS_PER_ITER * 1000000 / cycles);
+}
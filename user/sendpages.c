@@ -0,0 +1,52 @@
+// Send many pages to a child in one IPC message: a contiguous range
+// and two pages from elsewhere, which the child receives side by side
+// in one window.
+
+#include <inc/lib.h>
+
+#define NRANGE		32
+#define RANGE_ADDR	((char*)0xa00000)
+#define EXTRA_ADDR	((char*)0xc00000)
+#define WINDOW_ADDR	((char*)0xe00000)
+#define PERM		(PTE_P | PTE_W | PTE_U)
+
+void
+umain(int argc, char **argv)
+{
+	struct IpcSeg segs[3];
+	envid_t who;
+	int i, n, r;
+
+	if ((who = fork()) == 0) {
+		// Child
+		ipc_recvv(&who, WINDOW_ADDR, NRANGE + 2, 0, &n);
+		cprintf("%x sent %d pages\n", who, n);
+		for (i = 0; i < n; i++)
+			if (*(int*)(WINDOW_ADDR + i * PGSIZE) != i)
+				panic("page %d holds %d", i,
+				      *(int*)(WINDOW_ADDR + i * PGSIZE));
+		if (n != NRANGE + 2)
+			panic("received %d pages, not %d", n, NRANGE + 2);
+		cprintf("child received correct pages\n");
+		return;
+	}
+
+	// Parent
+	if ((r = sys_page_alloc_range(0, RANGE_ADDR, NRANGE, PERM)) != NRANGE)
+		panic("sys_page_alloc_range: %e", r);
+	for (i = 0; i < NRANGE; i++)
+		*(int*)(RANGE_ADDR + i * PGSIZE) = i;
+	for (i = 0; i < 2; i++) {
+		if ((r = sys_page_alloc(0, EXTRA_ADDR + 2 * i * PGSIZE, PERM)) < 0)
+			panic("sys_page_alloc: %e", r);
+		*(int*)(EXTRA_ADDR + 2 * i * PGSIZE) = NRANGE + i;
+	}
+	segs[0].is_va = RANGE_ADDR;
+	segs[0].is_npages = NRANGE;
+	segs[1].is_va = EXTRA_ADDR;
+	segs[1].is_npages = 1;
+	segs[2].is_va = EXTRA_ADDR + 2 * PGSIZE;
+	segs[2].is_npages = 1;
+	ipc_sendv(who, 0, segs, 3, PERM);
+	wait(who);
+}
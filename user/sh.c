@@ -156,25 +156,16 @@ runit:
 		cprintf("spawn %s: %e\n", argv[0], r);
 
 	// In the parent, close all file descriptors and wait for the
-	// spawned command to exit.
+	// spawned command to exit, and, if we were the left-hand part
+	// of a pipe, for the right-hand part too.  They are our only
+	// children, so reap them in whatever order they finish.
 	close_all();
-	if (r >= 0) {
+	if (debug)
+		cprintf("[%08x] WAIT %s %08x pipe_child %08x\n",
+			thisenv->env_id, argv[0], r, pipe_child);
+	while ((r = wait_any()) >= 0)
 		if (debug)
-			cprintf("[%08x] WAIT %s %08x\n", thisenv->env_id, argv[0], r);
-		wait(r);
-		if (debug)
-			cprintf("[%08x] wait finished\n", thisenv->env_id);
-	}
-
-	// If we were the left-hand part of a pipe,
-	// wait for the right-hand part to finish.
-	if (pipe_child) {
-		if (debug)
-			cprintf("[%08x] WAIT pipe_child %08x\n", thisenv->env_id, pipe_child);
-		wait(pipe_child);
-		if (debug)
-			cprintf("[%08x] wait finished\n", thisenv->env_id);
-	}
+			cprintf("[%08x] wait finished %08x\n", thisenv->env_id, r);
 
 	// Done!
 	exit();
@@ -0,0 +1,60 @@
+// System call round-trip benchmark.
+//
+// Times ITERS calls of sys_getenvid, which does almost nothing in the
+// kernel, through the fast sysenter path that lib/syscall.c uses when
+// the CPU has it, and through the generic int $T_SYSCALL path, then
+// does the same for sys_yield, which always saves the trap frame.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define ITERS	10000
+
+// Make system call 'num' with no arguments through int $T_SYSCALL.
+static inline int32_t
+syscall_int(int num)
+{
+	int32_t ret;
+
+	asm volatile("int %1"
+		     : "=a" (ret)
+		     : "i" (T_SYSCALL), "a" (num)
+		     : "cc", "memory");
+	return ret;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start, fast, slow;
+	int i;
+
+	if (!cpu_has_sysenter())
+		cprintf("sysbench: no sysenter, both paths use int $T_SYSCALL\n");
+
+	start = read_tsc();
+	for (i = 0; i < ITERS; i++)
+		sys_getenvid();
+	fast = read_tsc() - start;
+
+	start = read_tsc();
+	for (i = 0; i < ITERS; i++)
+		syscall_int(SYS_getenvid);
+	slow = read_tsc() - start;
+
+	cprintf("sysbench: getenvid: sysenter %llu cycles/call, "
+		"int %llu cycles/call\n", fast / ITERS, slow / ITERS);
+
+	start = read_tsc();
+	for (i = 0; i < ITERS; i++)
+		sys_yield();
+	fast = read_tsc() - start;
+
+	start = read_tsc();
+	for (i = 0; i < ITERS; i++)
+		syscall_int(SYS_yield);
+	slow = read_tsc() - start;
+
+	cprintf("sysbench: yield: sysenter %llu cycles/call, "
+		"int %llu cycles/call\n", fast / ITERS, slow / ITERS);
+}